@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+#include "chatty.h"
+
+// Measures how fast a request with one very large message is turned into
+// JSON. The baseline builds a cJSON tree and prints it, escaping the message
+// a byte at a time in print_string_ptr. libchatty writes the JSON directly,
+// scanning 16 or 32 bytes at a time for characters that need escaping and
+// copying everything in between with memcpy.
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Prose: a newline every line and the odd quote, like a pasted document
+static char *make_prose(size_t len)
+{
+    static const char *words[] = {"the", "request", "model", "latency", "a",
+                                  "of", "tokens", "provider", "stream", "and"};
+    char *text = malloc(len + 1);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    size_t i = 0;
+    size_t line = 0;
+    for (unsigned n = 0; i < len; n = n * 1103515245u + 12345u)
+    {
+        const char *word = words[(n >> 16) % 10];
+        for (; *word != '\0' && i < len; word++, line++)
+        {
+            text[i++] = *word;
+        }
+        if (i < len)
+        {
+            text[i++] = line > 72 ? '\n' : (n >> 8) % 50 == 0 ? '"' : ' ';
+            line = text[i - 1] == '\n' ? 0 : line + 1;
+        }
+    }
+    text[len] = '\0';
+    return text;
+}
+
+// Source code: indented with tabs, full of quotes and backslashes
+static char *make_code(size_t len)
+{
+    static const char line[] =
+        "\tif (strcmp(name, \"C:\\\\tmp\") == 0) {\n"
+        "\t\tprintf(\"%s\\n\", name);\n\t}\n";
+    char *text = malloc(len + 1);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        text[i] = line[i % (sizeof(line) - 1)];
+    }
+    text[len] = '\0';
+    return text;
+}
+
+static char *print_baseline(chatty_Message *message, char *model)
+{
+    cJSON *root = cJSON_CreateObject();
+    cJSON *messages = cJSON_AddArrayToObject(root, "messages");
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddStringToObject(item, "role", "user");
+    cJSON_AddStringToObject(item, "content", message->message);
+    cJSON_AddItemToArray(messages, item);
+    cJSON_AddStringToObject(root, "model", model);
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json;
+}
+
+static char *print_chatty(chatty_Message *message, char *model)
+{
+    chatty_Options options;
+    memset(&options, 0, sizeof(options));
+    options.model = model;
+    return chatty_to_json_string(1, message, options, false);
+}
+
+static double run(char *(*print)(chatty_Message *, char *),
+                  chatty_Message *message, int iterations)
+{
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++)
+    {
+        free(print(message, "gpt-4o-mini"));
+    }
+    return (now_ms() - start) / iterations;
+}
+
+static void report(const char *name, double ms, size_t len)
+{
+    printf("  %-10s %10.2f ms %10.0f MB/s\n", name, ms,
+           len / (1024.0 * 1024.0) / (ms / 1000.0));
+}
+
+int main(int argc, char *argv[])
+{
+    int megabytes = argc >= 2 ? atoi(argv[1]) : 8;
+    int iterations = argc >= 3 ? atoi(argv[2]) : 10;
+    if (megabytes <= 0 || iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [megabytes] [iterations]\n", argv[0]);
+        return 1;
+    }
+    size_t len = (size_t)megabytes * 1024 * 1024;
+
+    struct
+    {
+        const char *name;
+        char *(*make)(size_t len);
+    } inputs[] = {{"prose", make_prose}, {"code", make_code}};
+
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+    {
+        char *text = inputs[i].make(len);
+        if (text == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        chatty_Message message = {0};
+        message.role = CHATTY_USER;
+        message.message = text;
+
+        // Both must produce the same bytes, or the comparison is meaningless
+        char *expected = print_baseline(&message, "gpt-4o-mini");
+        char *actual = print_chatty(&message, "gpt-4o-mini");
+        if (expected == NULL || actual == NULL || strcmp(expected, actual) != 0)
+        {
+            fprintf(stderr, "Output differs from cJSON on %s\n", inputs[i].name);
+            return 1;
+        }
+        free(expected);
+        free(actual);
+
+        printf("%d MB of %s, %d iterations\n", megabytes, inputs[i].name, iterations);
+        report("baseline", run(print_baseline, &message, iterations), len);
+        report("libchatty", run(print_chatty, &message, iterations), len);
+        free(text);
+    }
+    return 0;
+}
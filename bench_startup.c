@@ -0,0 +1,147 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <curl/curl.h>
+
+#include "chatty.h"
+
+// Measures what a cold connection costs before the first byte of a request
+// goes out: DNS, TCP, TLS and loading the CA bundle. The baseline opens a
+// bare libcurl handle per connection, the way every chatty_chat() call used
+// to, so the CA bundle is re-read and re-parsed each time. libchatty parses
+// it once per process. TLS sessions are never resumed in either mode, so the
+// difference is the trust store.
+
+typedef struct bench_Sample
+{
+    double wall_ms;
+    long minor_faults;
+} bench_Sample;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static long minor_faults(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static size_t discard(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    (void)contents;
+    (void)userp;
+    return size * nmemb;
+}
+
+static int connect_baseline(const char *url)
+{
+    CURL *curl = curl_easy_init();
+    if (!curl)
+    {
+        return 1;
+    }
+    // libchatty honors CURL_CA_BUNDLE, so the baseline does too
+    const char *ca_bundle = getenv("CURL_CA_BUNDLE");
+    if (ca_bundle != NULL)
+    {
+        curl_easy_setopt(curl, CURLOPT_CAINFO, ca_bundle);
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    return res != CURLE_OK;
+}
+
+static int connect_chatty(const char *base_url)
+{
+    chatty_ClientOptions options = {0};
+    options.base_url = base_url;
+    options.api_key = "bench"; // The probe only needs the handshake
+    options.isolated_cache = true; // No TLS resumption between iterations
+
+    chatty_Client *client;
+    if (chatty_client_new(&options, &client) != CHATTY_SUCCESS)
+    {
+        return 1;
+    }
+    enum chatty_ERROR error = chatty_client_warmup(client);
+    chatty_client_free(client);
+    return error != CHATTY_SUCCESS;
+}
+
+static void report(const char *name, bench_Sample total, int iterations)
+{
+    printf("%-10s %10.2f ms/conn %10.1f minor faults/conn\n", name,
+           total.wall_ms / iterations, (double)total.minor_faults / iterations);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc >= 2 ? atoi(argv[1]) : 20;
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    const char *base_url = getenv("OPENAI_API_BASE");
+    if (base_url == NULL)
+    {
+        base_url = "https://api.openai.com/v1";
+    }
+    size_t url_len = strlen(base_url) + strlen("/models") + 1;
+    char *url = malloc(url_len);
+    if (url == NULL)
+    {
+        return 1;
+    }
+    snprintf(url, url_len, "%s/models", base_url);
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    // Warm both paths once so one-time library initialization isn't counted
+    if (connect_baseline(url) != 0 || connect_chatty(base_url) != 0)
+    {
+        fprintf(stderr, "Could not connect to %s\n", base_url);
+        free(url);
+        return 1;
+    }
+
+    bench_Sample baseline = {0, 0};
+    bench_Sample chatty = {0, 0};
+    for (int i = 0; i < iterations; i++)
+    {
+        long faults = minor_faults();
+        double start = now_ms();
+        connect_baseline(url);
+        baseline.wall_ms += now_ms() - start;
+        baseline.minor_faults += minor_faults() - faults;
+
+        faults = minor_faults();
+        start = now_ms();
+        connect_chatty(base_url);
+        chatty.wall_ms += now_ms() - start;
+        chatty.minor_faults += minor_faults() - faults;
+    }
+
+    printf("%d cold connections to %s\n", iterations, base_url);
+    report("baseline", baseline, iterations);
+    report("libchatty", chatty, iterations);
+
+    free(url);
+    curl_global_cleanup();
+    return 0;
+}
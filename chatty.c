@@ -1,11 +1,74 @@
+#define _POSIX_C_SOURCE 200809L /* strdup, clock_gettime */
+
 #include "chatty.h"
 
+#include <fcntl.h>
+#include <float.h>
+#include <locale.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #define CURL_NO_OLDIES
 #include "cJSON.h"
 #include <curl/curl.h>
+#include <pthread.h>
+#ifdef CHATTY_USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CHATTY_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* Hedging policy. A duplicate spends one unit of the upstream's budget and
+   each hedged request earns a twentieth back, so at most 5% of requests are
+   sent twice. The p95 delay needs a window of recent samples first. */
+#define CHATTY_TTFB_SAMPLES 64
+#define CHATTY_TTFB_MIN_SAMPLES 20
+#define CHATTY_HEDGE_BUDGET 5.0
+#define CHATTY_HEDGE_BUDGET_REFILL 0.05
+
+/* Adaptive concurrency. The limit grows by one per limit's worth of
+   successes while demand saturates it, and shrinks by a quarter, at most
+   once per cooldown, on 429s, timeouts or a time to first byte twice the
+   upstream's p10. Queued requests also recheck for slots released by other
+   clients every CHATTY_QUEUE_POLL_MS. */
+#define CHATTY_CONCURRENCY_INITIAL 8.0
+#define CHATTY_CONCURRENCY_MAX 256.0
+#define CHATTY_CONCURRENCY_BACKOFF 0.75
+#define CHATTY_CONCURRENCY_COOLDOWN_MS 100
+#define CHATTY_QUEUE_POLL_MS 10
+
+/* Routing between a client's endpoints. Each upstream keeps moving averages
+   of its time to first byte and of how often attempts fail. A request goes
+   to the endpoint with the lowest latency, inflated by its error rate and
+   divided by its weight, except for one in CHATTY_ROUTE_EXPLORE that is
+   placed at random by weight so a slow or failing endpoint gets the chance
+   to show it recovered. */
+#define CHATTY_ROUTE_EWMA_ALPHA 0.2
+#define CHATTY_ROUTE_ERROR_PENALTY 4.0
+#define CHATTY_ROUTE_EXPLORE 20
+
+/* Circuit breaker. The error rate is taken over the last
+   CHATTY_BREAKER_WINDOW attempts, once CHATTY_BREAKER_MIN_SAMPLES came in,
+   so a couple of early failures can't open the circuit on their own. */
+#define CHATTY_BREAKER_WINDOW 20
+#define CHATTY_BREAKER_MIN_SAMPLES 10
+#define CHATTY_BREAKER_ERROR_RATE 0.5
+#define CHATTY_BREAKER_OPEN_MS 5000
+
+/* Blocking calls whose messages and images add up to CHATTY_LAZY_BODY_MIN
+   bytes or more write the request body as curl asks for it instead of all
+   at once, escaping or encoding at most CHATTY_BODY_CHUNK bytes at a time. */
+#define CHATTY_LAZY_BODY_MIN (1024 * 1024)
+#define CHATTY_BODY_CHUNK (64 * 1024)
 
 // Some lines taken from https://curl.se/libcurl/c/getinmemory.html
 struct chatty_Memory {
@@ -13,22 +76,310 @@ struct chatty_Memory {
   size_t size;
 };
 
+/* Growable output buffer, always NUL terminated once written to */
+typedef struct chatty_Buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+} chatty_Buffer;
+
+/* An image file mapped into memory, NULL data when it is empty */
+typedef struct chatty_Mapping {
+  const unsigned char *data;
+  size_t len;
+} chatty_Mapping;
+
+/* Progress of a request body written by chatty_read_body() */
+enum chatty_BodyStep {
+  CHATTY_BODY_HEAD,
+  CHATTY_BODY_CONTENT,
+  CHATTY_BODY_IMAGE,
+  CHATTY_BODY_TAIL,
+  CHATTY_BODY_DONE
+};
+
+/* One message of a conversation, serialized as a JSON object. Turns never
+   change once appended, so forks share their common history and a turn is
+   freed when the last conversation ending in or after it lets go. */
+typedef struct chatty_Turn {
+  struct chatty_Turn *parent; /* The message before, or NULL */
+  long refs; /* Conversations ending here and turns following it */
+  int count; /* Messages up to and including this one */
+  size_t start; /* Offset of json in the comma-joined history */
+  size_t len;
+  char *json;
+} chatty_Turn;
+
+struct chatty_Conversation {
+  chatty_Turn *last; /* NULL while empty */
+};
+
+/* The parts of a request that stay the same between calls, serialized once
+   into json: the opening with the leading messages, the model as a JSON
+   string, then the sampling parameters and schemas, each led by a comma */
+struct chatty_Template {
+  chatty_Buffer json;
+  size_t head_len;
+  size_t model_len;
+  size_t tail_len;
+  int count; /* Leading messages */
+};
+
 typedef struct chatty_StreamContext {
   chatty_StreamCallback callback;
   void *user_data;
   char line_buffer[4096]; /* Fixed buffer for line processing */
   size_t buffer_pos;
   bool error_occurred;
+  bool delivered; /* The callback has seen part of this attempt's reply */
+  int64_t last_event_ms; /* Last data: event, or the start of the attempt */
 } chatty_StreamContext;
 
+struct chatty_CancelToken {
+  pthread_mutex_t lock;
+  bool cancelled;
+  CURLM **multis; /* Multi handles driving requests that use the token */
+  int multi_count;
+  int multi_cap;
+};
+
 typedef struct chatty_RequestContext {
   char *base_url;
   char *api_key;
   char *chat_url;
   char *bearer_header;
   bool free_base_url;
+  bool free_api_key;
 } chatty_RequestContext;
 
+/* One of the provider's rate limits as reported by its x-ratelimit-*
+   headers, refilling linearly until the reported reset */
+typedef struct chatty_RateBucket {
+  double capacity;      /* Provider's limit, 0 while unknown */
+  double level;         /* Available, negative while requests are paced */
+  double refill_per_ms;
+  int64_t updated_ms;
+} chatty_RateBucket;
+
+enum { CHATTY_RATE_REQUESTS, CHATTY_RATE_TOKENS, CHATTY_RATE_KINDS };
+
+/* x-ratelimit-* values of the response being received, -1 when absent */
+typedef struct chatty_RateHeaders {
+  double limit[CHATTY_RATE_KINDS];
+  double remaining[CHATTY_RATE_KINDS];
+  int64_t reset_ms[CHATTY_RATE_KINDS];
+} chatty_RateHeaders;
+
+/* Rate limits of one API key at one provider, which reports them per key.
+   Entries live as long as the process. */
+typedef struct chatty_Quota {
+  uint64_t key_hash; /* Recognizes the key without keeping it around */
+  chatty_RateBucket rate[CHATTY_RATE_KINDS];
+  int64_t exhausted_until_ms; /* Skipped until then after a 429 */
+  struct chatty_Quota *next;
+} chatty_Quota;
+
+/* What the process has learned about one provider, shared by all its
+   clients. Entries live as long as the process. */
+typedef struct chatty_Upstream {
+  char *base_url;
+  int64_t ttfb_us[CHATTY_TTFB_SAMPLES]; /* Ring of recent times to first byte */
+  int ttfb_count;
+  int ttfb_next;
+  int64_t ttfb_p95_ms; /* -1 until enough samples came in */
+  int64_t ttfb_p10_ms; /* Baseline for the concurrency limiter, or -1 */
+  double hedge_budget;
+  double retry_budget; /* Spent by retries, see chatty_retry_delay() */
+  chatty_Quota *quotas; /* One per API key in use */
+  double concurrency_limit;
+  int in_flight; /* Requests holding one of the limit's slots */
+  int queued;    /* Requests waiting for a slot */
+  int64_t last_decrease_ms;
+  double ewma_latency_ms; /* Time to first byte of successes, -1 before one */
+  double ewma_error;      /* Share of recent attempts that failed */
+  bool breaker_window[CHATTY_BREAKER_WINDOW]; /* True for failed attempts */
+  int breaker_count;
+  int breaker_next;
+  int breaker_failures; /* Failed attempts in the window */
+  enum chatty_CircuitState circuit;
+  int64_t circuit_changed_ms; /* When it opened or last let a trial through */
+  long circuit_opens;
+  struct chatty_Upstream *next;
+} chatty_Upstream;
+
+/* One of an endpoint's API keys, with its headers built once */
+typedef struct chatty_ClientKey {
+  chatty_Quota *quota;
+  struct curl_slist *json_headers;
+  struct curl_slist *stream_headers;
+} chatty_ClientKey;
+
+/* One of the providers a client routes requests to */
+typedef struct chatty_ClientEndpoint {
+  chatty_RequestContext ctx; /* The default provider's if shared */
+  bool shared; /* Context, upstream and key are the process-wide default's */
+  char *base_url; /* Owned copies of the chatty_Endpoint strings */
+  char *api_key;
+  char *model; /* Replaces chatty_Options.model, or NULL */
+  double weight;
+  bool backup;
+  chatty_Upstream *upstream;
+  chatty_ClientKey *keys;
+  int key_count;
+  int next_key; /* Where the search for the least used key starts */
+  char *models_url; /* Target of warmup probes, built on first use */
+  chatty_Request *queue_head; /* Requests waiting for a concurrency slot */
+  chatty_Request *queue_tail;
+} chatty_ClientEndpoint;
+
+struct chatty_Request {
+  chatty_Client *client;
+  chatty_ClientEndpoint *endpoint; /* Where the payload was serialized for */
+  chatty_ClientKey *key;
+  CURL *curl; /* Kept when the request is recycled */
+  const char *payload; /* In body, or borrowed from the origin of a race */
+  size_t payload_len;
+  chatty_Buffer body; /* Kept when the request is recycled */
+  chatty_Message *msgv; /* Borrowed while the body is written lazily */
+  int msgc;
+  chatty_Options options;   /* What the lazily written body asks for */
+  enum chatty_BodyStep read_step;
+  int read_message; /* Message whose text is being written */
+  const struct iovec *read_iov; /* Its text */
+  int read_iovcnt;
+  struct iovec read_one; /* Backs read_iov for a message without iov */
+  int read_segment;
+  size_t read_offset; /* Bytes of that segment or image already written */
+  bool read_text_part; /* The message's content is an array led by its text */
+  int read_image;      /* Image of the message being encoded */
+  int read_map;        /* Its mapping in maps */
+  chatty_Mapping *maps; /* Every image in msgv, mapped before the transfer */
+  int map_count;
+  enum chatty_ERROR body_error; /* Why chatty_read_body() aborted */
+  size_t body_pos;    /* Bytes of body already handed to curl */
+  bool streaming;
+  bool probe; /* Connection warmup, never recycled */
+  bool in_flight;
+  int attempts;             /* Sends of the payload so far */
+  int64_t backoff_ms;       /* Last backoff, seeds the next one */
+  bool parked;              /* Off the multi handle until wake_at_ms */
+  int64_t wake_at_ms;
+  int64_t hedge_at_ms;             /* When to race a duplicate, or -1 */
+  struct chatty_Request *hedge;    /* Duplicate racing this request */
+  struct chatty_Request *origin;   /* On a duplicate, the request it races for */
+  struct chatty_Request *winner;   /* Attempt that answered first */
+  bool lost; /* Own transfer dropped, the duplicate carries the request */
+  int64_t deadline_ms; /* End of the whole request, or -1 */
+  long connect_timeout_ms;
+  chatty_CancelToken *cancel;
+  long idle_timeout_ms; /* Longest gap between stream events, 0 for none */
+  chatty_RateHeaders rate_headers;
+  bool has_slot; /* Counts against the upstream's concurrency limit */
+  bool queued;   /* Waiting in the endpoint's queue for a slot */
+  struct chatty_Request *queue_next;
+  struct chatty_Memory chunk;    /* Response sink for buffered requests */
+  chatty_StreamContext stream_ctx; /* Response sink for SSE requests */
+  chatty_CompletionCallback done;
+  void *user_data;
+  struct chatty_Request *prev; /* Links in client->active or client->idle */
+  struct chatty_Request *next;
+};
+
+struct chatty_Client {
+  chatty_ClientEndpoint *endpoints; /* The first one also owns the cache */
+  int endpoint_count;
+  CURLSH *share; /* Process-wide DNS and TLS session cache, NULL if isolated */
+  CURLM *multi; /* Drives every transfer and owns the shared connection pool */
+  chatty_Request *active;
+  int active_count;
+  chatty_Request *idle; /* Finished requests, recycled with their easy handles */
+  chatty_LoopSocketCallback loop_socket; /* Set when an external loop drives I/O */
+  chatty_LoopTimerCallback loop_timer;
+  void *loop_data;
+  int64_t curl_deadline_ms;  /* When curl wants chatty_loop_timeout(), or -1 */
+  int64_t armed_deadline_ms; /* What the host timer is currently set to */
+  long keep_warm_ms;
+  int64_t last_activity_ms; /* When a request last started or finished */
+  char *cache_path;         /* On-disk DNS and TLS session cache, or NULL */
+  struct curl_slist *resolve; /* Addresses loaded from the cache */
+  struct curl_slist *unpin;   /* Drops those addresses from the DNS cache */
+  bool unpinned;              /* A pinned address failed to connect */
+  char cache_addr[64];        /* Address of the last successful request */
+  long cache_port;
+  time_t cache_resolved_at;   /* When cache_addr was last looked up */
+  bool cache_dirty;
+  int max_retries;
+  int64_t retry_base_ms;
+  int64_t retry_max_ms;
+  int parked;          /* Active requests waiting to be (re)sent */
+  uint64_t rng;        /* xorshift64* state for backoff jitter */
+  long hedge_delay_ms; /* 0 never hedges, -1 hedges at the upstream's p95 */
+  bool hedge_settled;  /* A race was won, the loser awaits removal */
+  int cancellable;     /* Active requests with a cancel token */
+  int idle_watched;    /* Active requests with a stream idle timeout */
+  bool rate_governor;  /* Pace requests by the upstream's rate limits */
+  bool adaptive_concurrency;
+  int queued; /* Requests waiting in an endpoint's queue */
+  bool circuit_breaker;
+  double breaker_error_rate;
+  int64_t breaker_slow_ms; /* 0 when latency doesn't count */
+  int64_t breaker_open_ms;
+};
+
+/* DNS entries and TLS sessions shared by every client in the process, so a
+   session negotiated on one thread can be resumed on another. Connections
+   stay per client: libcurl does not support sharing them between concurrent
+   threads. Created on first use and kept for the lifetime of the process. */
+static CURLSH *chatty_share;
+static pthread_mutex_t chatty_share_locks[CURL_LOCK_DATA_LAST];
+static pthread_once_t chatty_share_once = PTHREAD_ONCE_INIT;
+
+static chatty_Upstream *chatty_upstreams;
+static pthread_mutex_t chatty_upstreams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Guards the reference counts of turns, which forks on other threads share */
+static pthread_mutex_t chatty_conversation_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef CHATTY_USE_OPENSSL
+/* The trust store, parsed once per process and handed to every TLS context
+   instead of having each handshake re-read and re-parse the CA bundle */
+static X509_STORE *chatty_ca_store;
+static pthread_once_t chatty_ca_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* Retry policy defaults. Each retry spends one unit of the base URL's budget,
+   shared by every client in the process, and each success earns a fraction
+   back, so under a sustained outage retries add at most that fraction to
+   the request rate. */
+#define CHATTY_RETRY_MAX 2
+#define CHATTY_RETRY_BASE_MS 500
+#define CHATTY_RETRY_CAP_MS 30000
+#define CHATTY_RETRY_BUDGET 10.0
+#define CHATTY_RETRY_BUDGET_REFILL 0.1
+
+/* Cached addresses older than this are ignored, as a stand-in for the DNS
+   TTL that libcurl does not expose */
+#define CHATTY_CACHE_DNS_MAX_AGE 300
+
+typedef struct chatty_CacheExport {
+  FILE *file;
+  const char *base_url;
+  const char *host;
+} chatty_CacheExport;
+
+typedef struct chatty_SyncResult {
+  bool finished;
+  enum chatty_ERROR error;
+  chatty_Message *response;
+} chatty_SyncResult;
+
+/* Milliseconds on a monotonic clock */
+static int64_t chatty_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static size_t chatty_write_memory(void *contents, size_t size, size_t nmemb,
                                   void *userp) {
   size_t realsize = size * nmemb;
@@ -79,10 +430,12 @@ static size_t chatty_write_stream(void *contents, size_t size, size_t nmemb,
       // Check if this is a data line
       if (strncmp(ctx->line_buffer, "data: ", 6) == 0) {
         char *json_data = ctx->line_buffer + 6;
+        ctx->last_event_ms = chatty_now_ms();
 
         // Handle completion signal
         if (strcmp(json_data, "[DONE]\n") == 0 ||
             strcmp(json_data, "[DONE]") == 0) {
+          ctx->delivered = true;
           if (ctx->callback(NULL, CHATTY_STREAM_DONE, ctx->user_data) != 0) {
             ctx->error_occurred = true;
             return 0;
@@ -103,6 +456,7 @@ static size_t chatty_write_stream(void *contents, size_t size, size_t nmemb,
                       cJSON_GetObjectItemCaseSensitive(delta, "content");
                   if (content != NULL && cJSON_IsString(content)) {
                     // Invoke callback with content
+                    ctx->delivered = true;
                     if (ctx->callback(content->valuestring, CHATTY_STREAM_CHUNK,
                                       ctx->user_data) != 0) {
                       ctx->error_occurred = true;
@@ -126,17 +480,44 @@ static size_t chatty_write_stream(void *contents, size_t size, size_t nmemb,
   return realsize;
 }
 
-cJSON *chatty_role_to_json(enum chatty_Role role) {
+/* Response sink of hedged requests. While two attempts race, the first to
+   receive a 200 body wins and the other is aborted on its next write. */
+static size_t chatty_write_hedged(void *contents, size_t size, size_t nmemb,
+                                  void *userp) {
+  chatty_Request *req = (chatty_Request *)userp;
+  chatty_Request *origin = req->origin != NULL ? req->origin : req;
+
+  if (origin->hedge != NULL) {
+    if (origin->winner == NULL) {
+      long http_code = 0;
+      curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_code);
+      if (http_code == 200) {
+        origin->winner = req;
+        req->client->hedge_settled = true;
+      }
+    } else if (origin->winner != req) {
+      return 0; // Lost the race
+    }
+  }
+
+  if (req->streaming) {
+    return chatty_write_stream(contents, size, nmemb, (void *)&req->stream_ctx);
+  }
+  return chatty_write_memory(contents, size, nmemb, (void *)&req->chunk);
+}
+
+static const char *chatty_role_name(enum chatty_Role role) {
   switch (role) {
   case CHATTY_SYSTEM:
-    return cJSON_CreateStringReference("system");
+    return "system";
   case CHATTY_USER:
-    return cJSON_CreateStringReference("user");
+    return "user";
   case CHATTY_ASSISTANT:
-    return cJSON_CreateStringReference("assistant");
+    return "assistant";
   case CHATTY_TOOL:
-    return cJSON_CreateStringReference("tool");
+    return "tool";
   }
+  return NULL;
 }
 
 enum chatty_Role chatty_role_from_json(cJSON *role) {
@@ -155,31 +536,104 @@ enum chatty_Role chatty_role_from_json(cJSON *role) {
   return -1;
 }
 
+/* Messages of the template and the conversation sent ahead of msgv */
+static int chatty_leading_count(const chatty_Options *options) {
+  int count = 0;
+  if (options->request_template != NULL) {
+    count += options->request_template->count;
+  }
+  if (options->conversation != NULL && options->conversation->last != NULL) {
+    count += options->conversation->last->count;
+  }
+  return count;
+}
+
+/* Whether temperature and top_p, when given, are in range */
+static bool chatty_sampling_valid(const chatty_Options *options) {
+  return (!options->has_temperature ||
+          (options->temperature >= 0.0 && options->temperature <= 2.0)) &&
+         (!options->has_top_p ||
+          (options->top_p >= 0.0 && options->top_p <= 1.0));
+}
+
+/* The MIME type of an image, guessed from its path unless given */
+static const char *chatty_image_mime_type(const chatty_Image *image) {
+  static const struct {
+    const char *extension;
+    const char *mime_type;
+  } types[] = {{".png", "image/png"},   {".jpg", "image/jpeg"},
+               {".jpeg", "image/jpeg"}, {".gif", "image/gif"},
+               {".webp", "image/webp"}};
+
+  if (image->mime_type != NULL || image->path == NULL) {
+    return image->mime_type;
+  }
+  const char *extension = strrchr(image->path, '.');
+  for (size_t i = 0; extension != NULL && i < sizeof(types) / sizeof(types[0]);
+       i++) {
+    if (strcasecmp(extension, types[i].extension) == 0) {
+      return types[i].mime_type;
+    }
+  }
+  return NULL;
+}
+
+/* Whether a message's text and images can be read. Roles are checked when
+   it is serialized, and files when they are opened. */
+static bool chatty_message_valid(const chatty_Message *message) {
+  if (message->image_count < 0 ||
+      (message->image_count > 0 && message->images == NULL)) {
+    return false;
+  }
+  for (int i = 0; i < message->image_count; i++) {
+    const chatty_Image *image = &message->images[i];
+    if ((image->path == NULL && image->fd < 0) ||
+        chatty_image_mime_type(image) == NULL) {
+      return false;
+    }
+  }
+  if (message->iov == NULL) {
+    return message->message != NULL;
+  }
+  if (message->iovcnt < 0) {
+    return false;
+  }
+  for (int i = 0; i < message->iovcnt; i++) {
+    if (message->iov[i].iov_base == NULL && message->iov[i].iov_len > 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* The model options ask for, NULL when unset or empty so that a template's
+   model applies */
+static const char *chatty_options_model(const chatty_Options *options) {
+  return options->model != NULL && options->model[0] != '\0' ? options->model
+                                                              : NULL;
+}
+
 /* Validate input parameters common to both chat functions */
 static enum chatty_ERROR chatty_validate_input(int msgc, chatty_Message msgv[],
                                                chatty_Options options) {
-  if (msgc <= 0 || msgv == NULL) {
-    return CHATTY_INVALID_OPTIONS;
-  }
-
-  if (options.model == NULL || strlen(options.model) == 0) {
+  int leading = chatty_leading_count(&options);
+  if (msgc < 0 || (msgc > 0 && msgv == NULL) || msgc + leading == 0) {
     return CHATTY_INVALID_OPTIONS;
   }
 
-  // Validate temperature range
-  if (options.has_temperature &&
-      (options.temperature < 0.0 || options.temperature > 2.0)) {
+  // A template brings its own model
+  if (chatty_options_model(&options) == NULL &&
+      options.request_template == NULL) {
     return CHATTY_INVALID_OPTIONS;
   }
 
-  // Validate top_p range
-  if (options.has_top_p && (options.top_p < 0.0 || options.top_p > 1.0)) {
+  if (!chatty_sampling_valid(&options)) {
     return CHATTY_INVALID_OPTIONS;
   }
 
   // Validate messages
   for (int i = 0; i < msgc; i++) {
-    if (msgv[i].message == NULL) {
+    if (!chatty_message_valid(&msgv[i])) {
       return CHATTY_INVALID_OPTIONS;
     }
   }
@@ -187,38 +641,57 @@ static enum chatty_ERROR chatty_validate_input(int msgc, chatty_Message msgv[],
   return CHATTY_SUCCESS;
 }
 
-/* Initialize request context with provider detection and authentication */
+/* Where each provider's key is read from, by base URL prefix. Anything
+   else is taken for an OpenAI-compatible API using OPENAI_API_KEY. */
+static const struct {
+  const char *base_url_prefix;
+  const char *key_env;
+} chatty_providers[] = {
+    {"https://api.groq.com", "GROQ_API_KEY"},
+    {"https://api.fireworks.ai", "FIREWORKS_API_KEY"},
+    {"https://api.mistral.ai", "MISTRAL_API_KEY"},
+    {"https://api.hyperbolic.xyz", "HYPERBOLIC_API_KEY"},
+    {"https://api.deepseek.com", "DEEPSEEK_API_KEY"},
+    {"https://api.llama.com", "LLAMA_API_KEY"},
+    {"https://api.moonshot.ai", "MOONSHOT_API_KEY"},
+};
+
+/* Initialize request context with provider detection and authentication.
+   base_url and api_key may be NULL, in which case they are read from the
+   environment. Explicit strings are borrowed, not copied. */
 static enum chatty_ERROR
-chatty_init_request_context(chatty_RequestContext *ctx) {
-  ctx->base_url = curl_getenv("OPENAI_API_BASE");
-  ctx->free_base_url = true;
-  if (ctx->base_url == NULL) {
-    ctx->base_url = "https://api.openai.com/v1";
+chatty_init_request_context(chatty_RequestContext *ctx, const char *base_url,
+                            const char *api_key) {
+  if (base_url != NULL) {
+    ctx->base_url = (char *)base_url;
     ctx->free_base_url = false;
+  } else {
+    ctx->base_url = curl_getenv("OPENAI_API_BASE");
+    ctx->free_base_url = true;
+    if (ctx->base_url == NULL) {
+      ctx->base_url = "https://api.openai.com/v1";
+      ctx->free_base_url = false;
+    }
   }
 
-  char *key_env = "OPENAI_API_KEY";
-  if (strstr(ctx->base_url, "https://api.groq.com") == ctx->base_url) {
-    key_env = "GROQ_API_KEY";
-  } else if (strstr(ctx->base_url, "https://api.fireworks.ai") ==
-             ctx->base_url) {
-    key_env = "FIREWORKS_API_KEY";
-  } else if (strstr(ctx->base_url, "https://api.mistral.ai") == ctx->base_url) {
-    key_env = "MISTRAL_API_KEY";
-  } else if (strstr(ctx->base_url, "https://api.hyperbolic.xyz") ==
-             ctx->base_url) {
-    key_env = "HYPERBOLIC_API_KEY";
-  } else if (strstr(ctx->base_url, "https://api.deepseek.com") ==
-             ctx->base_url) {
-    key_env = "DEEPSEEK_API_KEY";
-  } else if (strstr(ctx->base_url, "https://api.llama.com") == ctx->base_url) {
-    key_env = "LLAMA_API_KEY";
-  } else if (strstr(ctx->base_url, "https://api.moonshot.ai") ==
-             ctx->base_url) {
-    key_env = "MOONSHOT_API_KEY";
-  }
-
-  ctx->api_key = curl_getenv(key_env);
+  const char *key_env = "OPENAI_API_KEY";
+  for (size_t i = 0; i < sizeof(chatty_providers) / sizeof(chatty_providers[0]);
+       i++) {
+    size_t prefix_len = strlen(chatty_providers[i].base_url_prefix);
+    if (strncmp(ctx->base_url, chatty_providers[i].base_url_prefix,
+                prefix_len) == 0) {
+      key_env = chatty_providers[i].key_env;
+      break;
+    }
+  }
+
+  if (api_key != NULL) {
+    ctx->api_key = (char *)api_key;
+    ctx->free_api_key = false;
+  } else {
+    ctx->api_key = curl_getenv(key_env);
+    ctx->free_api_key = true;
+  }
   if (ctx->api_key == NULL) {
     if (ctx->free_base_url) {
       curl_free(ctx->base_url);
@@ -233,7 +706,9 @@ chatty_init_request_context(chatty_RequestContext *ctx) {
     if (ctx->free_base_url) {
       curl_free(ctx->base_url);
     }
-    curl_free(ctx->api_key);
+    if (ctx->free_api_key) {
+      curl_free(ctx->api_key);
+    }
     return CHATTY_MEMORY_ERROR;
   }
   snprintf(ctx->chat_url, chat_url_len, "%s/chat/completions", ctx->base_url);
@@ -246,7 +721,9 @@ chatty_init_request_context(chatty_RequestContext *ctx) {
     if (ctx->free_base_url) {
       curl_free(ctx->base_url);
     }
-    curl_free(ctx->api_key);
+    if (ctx->free_api_key) {
+      curl_free(ctx->api_key);
+    }
     free(ctx->chat_url);
     return CHATTY_MEMORY_ERROR;
   }
@@ -261,7 +738,7 @@ static void chatty_cleanup_request_context(chatty_RequestContext *ctx) {
   if (ctx->free_base_url && ctx->base_url) {
     curl_free(ctx->base_url);
   }
-  if (ctx->api_key) {
+  if (ctx->free_api_key && ctx->api_key) {
     curl_free(ctx->api_key);
   }
   if (ctx->chat_url) {
@@ -272,280 +749,4149 @@ static void chatty_cleanup_request_context(chatty_RequestContext *ctx) {
   }
 }
 
-/* Initialize and configure CURL handle with common settings */
-static enum chatty_ERROR chatty_setup_curl(CURL **curl,
-                                           chatty_RequestContext *ctx,
-                                           const char *payload,
-                                           bool streaming) {
-  curl_global_init(CURL_GLOBAL_ALL);
-
-  *curl = curl_easy_init();
-  if (!*curl) {
-    curl_global_cleanup();
-    return CHATTY_CURL_INIT_ERROR;
-  }
-
-  curl_easy_setopt(*curl, CURLOPT_USERAGENT, "libchatty/1.0");
-  curl_easy_setopt(*curl, CURLOPT_URL, ctx->chat_url);
-  curl_easy_setopt(*curl, CURLOPT_POSTFIELDS, payload);
-
-  return CHATTY_SUCCESS;
+static void chatty_share_lock(CURL *handle, curl_lock_data data,
+                              curl_lock_access access, void *userptr) {
+  (void)handle;
+  (void)access;
+  (void)userptr;
+  pthread_mutex_lock(&chatty_share_locks[data]);
 }
 
-/* Create HTTP headers for the request */
-static struct curl_slist *chatty_create_headers(chatty_RequestContext *ctx,
-                                                bool streaming) {
-  struct curl_slist *headers = NULL;
-  headers = curl_slist_append(headers, "Content-Type: application/json");
-  if (streaming) {
-    headers = curl_slist_append(headers, "Accept: text/event-stream");
-  } else {
-    headers = curl_slist_append(headers, "Accept: application/json");
-  }
-  headers = curl_slist_append(headers, ctx->bearer_header);
-  return headers;
+static void chatty_share_unlock(CURL *handle, curl_lock_data data,
+                                void *userptr) {
+  (void)handle;
+  (void)userptr;
+  pthread_mutex_unlock(&chatty_share_locks[data]);
 }
 
-/* Allocates string that needs to be freed */
-char *chatty_to_json_string(int msgc, chatty_Message msgv[],
-                            chatty_Options options, bool stream) {
-  if (options.model == NULL) {
-    return NULL;
+static void chatty_share_init(void) {
+  // Hold a reference of our own so the share never outlives libcurl's state
+  if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+    return;
   }
 
-  cJSON *json = cJSON_CreateObject();
-  cJSON *messages = cJSON_CreateArray();
-
-  for (int i = 0; i < msgc; i++) {
-    cJSON *message = cJSON_CreateObject();
-    cJSON_AddItemToObjectCS(message, "role", chatty_role_to_json(msgv[i].role));
-    cJSON_AddItemToObjectCS(message, "content",
-                            cJSON_CreateString(msgv[i].message));
-    cJSON_AddItemToArray(messages, message);
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&chatty_share_locks[i], NULL);
   }
 
-  cJSON_AddItemToObjectCS(json, "messages", messages);
-  cJSON_AddItemToObjectCS(json, "model", cJSON_CreateString(options.model));
-  if (options.has_temperature) {
-    cJSON_AddItemToObjectCS(json, "temperature",
-                            cJSON_CreateNumber(options.temperature));
-  }
-  if (options.has_top_p) {
-    cJSON_AddItemToObjectCS(json, "top_p", cJSON_CreateNumber(options.top_p));
+  CURLSH *share = curl_share_init();
+  if (share == NULL) {
+    return;
   }
-  if (stream) {
-    cJSON_AddItemToObjectCS(json, "stream", cJSON_CreateBool(true));
-  }
-
-  char *json_string = cJSON_Print(json);
-  cJSON_Delete(json);
-  return json_string;
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, chatty_share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, chatty_share_unlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  chatty_share = share;
 }
 
-/* A non-zero return value indicates an error.
-   response will contain the response chat message.
-   You'll need to free response.message yourself. */
-enum chatty_ERROR chatty_chat(int msgc, chatty_Message msgv[],
-                              chatty_Options options,
-                              chatty_Message *response) {
-  // Input validation
-  if (response == NULL) {
-    return CHATTY_INVALID_OPTIONS;
+#ifdef CHATTY_USE_OPENSSL
+static void chatty_ca_init(void) {
+  // The store is only meaningful to a libcurl that itself runs on OpenSSL
+  curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+  if (info->ssl_version == NULL ||
+      strncmp(info->ssl_version, "OpenSSL", strlen("OpenSSL")) != 0) {
+    return;
   }
 
-  enum chatty_ERROR error = chatty_validate_input(msgc, msgv, options);
-  if (error != CHATTY_SUCCESS) {
-    return error;
+  CURL *curl = curl_easy_init();
+  if (curl == NULL) {
+    return;
   }
 
-  // Initialize request context
-  chatty_RequestContext ctx;
-  error = chatty_init_request_context(&ctx);
-  if (error != CHATTY_SUCCESS) {
-    return error;
+  // Same locations curl would load, CURL_CA_BUNDLE overriding the file
+  char *ca_file = NULL;
+  char *ca_path = NULL;
+  char *ca_env = curl_getenv("CURL_CA_BUNDLE");
+  if (ca_env != NULL) {
+    ca_file = ca_env;
+  } else {
+    curl_easy_getinfo(curl, CURLINFO_CAINFO, &ca_file);
+    curl_easy_getinfo(curl, CURLINFO_CAPATH, &ca_path);
   }
 
-  // Generate JSON payload
-  char *payload = chatty_to_json_string(msgc, msgv, options, false);
-  if (payload == NULL) {
-    chatty_cleanup_request_context(&ctx);
-    return CHATTY_INVALID_OPTIONS;
-  }
+  X509_STORE *store = X509_STORE_new();
+  if (store != NULL) {
+    bool loaded = false;
+    if (ca_file != NULL && X509_STORE_load_locations(store, ca_file, NULL)) {
+      loaded = true;
+    }
+    if (ca_path != NULL && X509_STORE_load_locations(store, NULL, ca_path)) {
+      loaded = true;
+    }
+    if (!loaded && ca_env == NULL && X509_STORE_set_default_paths(store)) {
+      loaded = true;
+    }
 
-  // Set up CURL
-  CURL *curl;
-  error = chatty_setup_curl(&curl, &ctx, payload, false);
-  if (error != CHATTY_SUCCESS) {
-    free(payload);
-    chatty_cleanup_request_context(&ctx);
-    return error;
+    if (loaded) {
+      chatty_ca_store = store;
+    } else {
+      X509_STORE_free(store);
+    }
   }
 
-  // Set up memory buffer for response
-  struct chatty_Memory chunk;
-  chunk.memory = malloc(1);
-  if (chunk.memory == NULL) {
-    free(payload);
-    curl_easy_cleanup(curl);
-    curl_global_cleanup();
-    chatty_cleanup_request_context(&ctx);
-    return CHATTY_MEMORY_ERROR;
-  }
-  chunk.size = 0;
+  curl_free(ca_env);
+  curl_easy_cleanup(curl);
+}
 
-  // Configure CURL for non-streaming
-  struct curl_slist *headers = chatty_create_headers(&ctx, false);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, chatty_write_memory);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+static CURLcode chatty_ssl_ctx_cb(CURL *curl, void *ssl_ctx, void *userptr) {
+  (void)curl;
+  X509_STORE *store = (X509_STORE *)userptr;
 
-  // Perform request
-  CURLcode res = curl_easy_perform(curl);
-  long http_code = 0;
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+  // The context takes over one reference and drops its own empty store
+  X509_STORE_up_ref(store);
+  SSL_CTX_set_cert_store((SSL_CTX *)ssl_ctx, store);
+  return CURLE_OK;
+}
+#endif
 
-  // Cleanup request resources
-  free(payload);
-  curl_slist_free_all(headers);
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
-  chatty_cleanup_request_context(&ctx);
+static bool chatty_token_cancelled(chatty_CancelToken *token) {
+  pthread_mutex_lock(&token->lock);
+  bool cancelled = token->cancelled;
+  pthread_mutex_unlock(&token->lock);
+  return cancelled;
+}
 
-  if (res != CURLE_OK || http_code != 200) {
-    free(chunk.memory);
-    return CHATTY_CURL_NETWORK_ERROR;
+/* Make chatty_cancel() wake up the multi handle driving a request */
+static bool chatty_token_watch(chatty_CancelToken *token, CURLM *multi) {
+  pthread_mutex_lock(&token->lock);
+  if (token->multi_count == token->multi_cap) {
+    int cap = token->multi_cap > 0 ? token->multi_cap * 2 : 4;
+    CURLM **multis = realloc(token->multis, sizeof(CURLM *) * cap);
+    if (multis == NULL) {
+      pthread_mutex_unlock(&token->lock);
+      return false;
+    }
+    token->multis = multis;
+    token->multi_cap = cap;
   }
+  token->multis[token->multi_count++] = multi;
+  pthread_mutex_unlock(&token->lock);
+  return true;
+}
 
-  bool json_parse_fail = false;
-  cJSON *response_json = cJSON_Parse(chunk.memory);
-  if (response_json == NULL) {
-    json_parse_fail = true;
-    goto parse_end;
+static void chatty_token_unwatch(chatty_CancelToken *token, CURLM *multi) {
+  pthread_mutex_lock(&token->lock);
+  for (int i = 0; i < token->multi_count; i++) {
+    if (token->multis[i] == multi) {
+      token->multis[i] = token->multis[--token->multi_count];
+      break;
+    }
   }
-  cJSON *choices = cJSON_GetObjectItemCaseSensitive(response_json, "choices");
-  if (choices == NULL || cJSON_GetArraySize(choices) == 0) {
-    json_parse_fail = true;
-    goto parse_end;
+  pthread_mutex_unlock(&token->lock);
+}
+
+/* Aborts a cancelled transfer from inside curl, wherever it is stuck */
+static int chatty_xferinfo(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                           curl_off_t ultotal, curl_off_t ulnow) {
+  (void)dltotal;
+  (void)dlnow;
+  (void)ultotal;
+  (void)ulnow;
+  return chatty_token_cancelled((chatty_CancelToken *)clientp) ? 1 : 0;
+}
+
+/* Returns the process-wide share, or NULL if it could not be created */
+static CURLSH *chatty_get_share(void) {
+  pthread_once(&chatty_share_once, chatty_share_init);
+  return chatty_share;
+}
+
+/* Returns the process-wide record for base_url, creating it on first use,
+   or NULL if out of memory */
+static chatty_Upstream *chatty_get_upstream(const char *base_url) {
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  chatty_Upstream *upstream = chatty_upstreams;
+  while (upstream != NULL && strcmp(upstream->base_url, base_url) != 0) {
+    upstream = upstream->next;
   }
-  cJSON *choice = cJSON_GetArrayItem(choices, 0);
-  if (choice == NULL) {
-    json_parse_fail = true;
-    goto parse_end;
+  if (upstream == NULL) {
+    upstream = calloc(1, sizeof(chatty_Upstream));
+    if (upstream != NULL) {
+      upstream->base_url = strdup(base_url);
+      if (upstream->base_url == NULL) {
+        free(upstream);
+        upstream = NULL;
+      } else {
+        upstream->ttfb_p95_ms = -1;
+        upstream->ttfb_p10_ms = -1;
+        upstream->retry_budget = CHATTY_RETRY_BUDGET;
+        upstream->concurrency_limit = CHATTY_CONCURRENCY_INITIAL;
+        upstream->ewma_latency_ms = -1;
+        upstream->next = chatty_upstreams;
+        chatty_upstreams = upstream;
+      }
+    }
   }
-  cJSON *message = cJSON_GetObjectItemCaseSensitive(choice, "message");
-  if (message == NULL) {
-    json_parse_fail = true;
-    goto parse_end;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  return upstream;
+}
+
+/* FNV-1a */
+static uint64_t chatty_hash_key(const char *api_key) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (const unsigned char *c = (const unsigned char *)api_key; *c != '\0';
+       c++) {
+    hash = (hash ^ *c) * 0x100000001B3ULL;
   }
-  cJSON *role = cJSON_GetObjectItemCaseSensitive(message, "role");
-  if (role == NULL) {
-    json_parse_fail = true;
-    goto parse_end;
+  return hash;
+}
+
+/* Find or add the upstream's quota for an API key */
+static chatty_Quota *chatty_get_quota(chatty_Upstream *upstream,
+                                      const char *api_key) {
+  uint64_t key_hash = chatty_hash_key(api_key);
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  chatty_Quota *quota = upstream->quotas;
+  while (quota != NULL && quota->key_hash != key_hash) {
+    quota = quota->next;
   }
-  enum chatty_Role role_enum = chatty_role_from_json(role);
-  if (role_enum == -1) {
-    json_parse_fail = true;
-    goto parse_end;
+  if (quota == NULL) {
+    quota = calloc(1, sizeof(chatty_Quota));
+    if (quota != NULL) {
+      quota->key_hash = key_hash;
+      quota->next = upstream->quotas;
+      upstream->quotas = quota;
+    }
   }
-  cJSON *content = cJSON_GetObjectItemCaseSensitive(message, "content");
-  if (content == NULL) {
-    json_parse_fail = true;
-    goto parse_end;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  return quota;
+}
+
+static int chatty_compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Add a time to first byte to the upstream's window and refresh its p95 */
+static void chatty_upstream_record_ttfb(chatty_Upstream *upstream,
+                                        int64_t ttfb_us) {
+  int64_t sorted[CHATTY_TTFB_SAMPLES];
+
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  upstream->ttfb_us[upstream->ttfb_next] = ttfb_us;
+  upstream->ttfb_next = (upstream->ttfb_next + 1) % CHATTY_TTFB_SAMPLES;
+  if (upstream->ttfb_count < CHATTY_TTFB_SAMPLES) {
+    upstream->ttfb_count++;
   }
+  int count = upstream->ttfb_count;
+  memcpy(sorted, upstream->ttfb_us, sizeof(int64_t) * count);
+  pthread_mutex_unlock(&chatty_upstreams_lock);
 
-parse_end:
-  if (!json_parse_fail) {
-    response->role = role_enum;
-    response->message = strdup(content->valuestring);
-    if (response->message == NULL) {
-      // cleanup
-      cJSON_Delete(response_json);
-      free(chunk.memory);
-      return CHATTY_MEMORY_ERROR;
-    }
+  if (count < CHATTY_TTFB_MIN_SAMPLES) {
+    return;
   }
+  qsort(sorted, count, sizeof(int64_t), chatty_compare_int64);
+  int64_t p95_ms = sorted[(count * 95) / 100] / 1000;
+  int64_t p10_ms = sorted[count / 10] / 1000;
 
-  // cleanup
-  cJSON_Delete(response_json); // Works even if response_json is NULL
-  free(chunk.memory);
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  upstream->ttfb_p95_ms = p95_ms;
+  upstream->ttfb_p10_ms = p10_ms;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+}
 
-  if (json_parse_fail) {
-    return CHATTY_JSON_PARSE_ERROR;
+/* Feed a finished attempt into the upstream's routing score. latency_ms is
+   the time to first byte of a success, or -1 for a failure. */
+static void chatty_upstream_record_outcome(chatty_Upstream *upstream,
+                                           double latency_ms) {
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  upstream->ewma_error += CHATTY_ROUTE_EWMA_ALPHA *
+                          ((latency_ms < 0 ? 1.0 : 0.0) - upstream->ewma_error);
+  if (latency_ms >= 0) {
+    if (upstream->ewma_latency_ms < 0) {
+      upstream->ewma_latency_ms = latency_ms;
+    } else {
+      upstream->ewma_latency_ms +=
+          CHATTY_ROUTE_EWMA_ALPHA * (latency_ms - upstream->ewma_latency_ms);
+    }
   }
-  return CHATTY_SUCCESS;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
 }
 
-enum chatty_ERROR chatty_chat_stream(int msgc, chatty_Message msgv[],
-                                     chatty_Options options,
-                                     chatty_StreamCallback callback,
-                                     void *user_data) {
-  // Input validation
-  if (callback == NULL) {
-    return CHATTY_INVALID_OPTIONS;
+/* Parses a rate limit reset such as "20ms", "6s" or "1m0.5s". A bare number
+   is in seconds. Returns -1 if there is nothing to parse. */
+static int64_t chatty_parse_reset(const char *value) {
+  double total_ms = 0;
+  bool parsed = false;
+  while (*value != '\0') {
+    char *end;
+    double amount = strtod(value, &end);
+    if (end == value) {
+      break;
+    }
+    parsed = true;
+    value = end;
+    if (strncmp(value, "ms", 2) == 0) {
+      total_ms += amount;
+      value += 2;
+    } else if (*value == 'h') {
+      total_ms += amount * 3600000;
+      value++;
+    } else if (*value == 'm') {
+      total_ms += amount * 60000;
+      value++;
+    } else {
+      total_ms += amount * 1000;
+      if (*value == 's') {
+        value++;
+      }
+    }
   }
+  return parsed ? (int64_t)total_ms : -1;
+}
 
-  enum chatty_ERROR error = chatty_validate_input(msgc, msgv, options);
-  if (error != CHATTY_SUCCESS) {
-    return error;
+/* Take what a response reported about the provider's limits as the truth */
+static void chatty_governor_update(chatty_Quota *quota,
+                                   const chatty_RateHeaders *headers) {
+  int64_t now = chatty_now_ms();
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  for (int kind = 0; kind < CHATTY_RATE_KINDS; kind++) {
+    chatty_RateBucket *bucket = &quota->rate[kind];
+    double remaining = headers->remaining[kind];
+    if (remaining < 0) {
+      continue;
+    }
+    if (headers->limit[kind] > 0) {
+      bucket->capacity = headers->limit[kind];
+    } else if (bucket->capacity < remaining) {
+      bucket->capacity = remaining;
+    }
+    if (headers->reset_ms[kind] > 0) {
+      bucket->refill_per_ms =
+          (bucket->capacity - remaining) / (double)headers->reset_ms[kind];
+    }
+    bucket->level = remaining;
+    bucket->updated_ms = now;
   }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+}
 
-  // Initialize request context
-  chatty_RequestContext ctx;
-  error = chatty_init_request_context(&ctx);
-  if (error != CHATTY_SUCCESS) {
-    return error;
+/* Reserve cost from a bucket. Returns how many milliseconds the caller has
+   to wait until the bucket has refilled enough to cover it. */
+static int64_t chatty_bucket_take(chatty_RateBucket *bucket, double cost,
+                                  int64_t now) {
+  if (bucket->capacity <= 0) {
+    return 0;
   }
-
-  // Generate JSON payload
-  char *payload = chatty_to_json_string(msgc, msgv, options, true);
-  if (payload == NULL) {
-    chatty_cleanup_request_context(&ctx);
-    return CHATTY_INVALID_OPTIONS;
+  if (bucket->refill_per_ms > 0) {
+    bucket->level += bucket->refill_per_ms * (double)(now - bucket->updated_ms);
+    if (bucket->level > bucket->capacity) {
+      bucket->level = bucket->capacity;
+    }
   }
+  bucket->updated_ms = now;
+  bucket->level -= cost;
+  if (bucket->level >= 0 || bucket->refill_per_ms <= 0) {
+    return 0;
+  }
+  return (int64_t)(-bucket->level / bucket->refill_per_ms) + 1;
+}
 
-  // Set up CURL
-  CURL *curl;
-  error = chatty_setup_curl(&curl, &ctx, payload, true);
-  if (error != CHATTY_SUCCESS) {
-    free(payload);
-    chatty_cleanup_request_context(&ctx);
-    return error;
+/* Hand back a reservation chatty_bucket_take() made */
+static void chatty_bucket_give(chatty_RateBucket *bucket, double cost) {
+  if (bucket->capacity > 0) {
+    bucket->level += cost;
   }
+}
 
-  // Set up streaming context
-  chatty_StreamContext stream_ctx;
-  stream_ctx.callback = callback;
-  stream_ctx.user_data = user_data;
-  stream_ctx.buffer_pos = 0;
-  stream_ctx.error_occurred = false;
+/* What is left in a bucket now, as a share of its capacity. Unknown limits
+   count as untouched. */
+static double chatty_bucket_headroom(const chatty_RateBucket *bucket,
+                                     int64_t now) {
+  if (bucket->capacity <= 0) {
+    return 1.0;
+  }
+  double level = bucket->level;
+  if (bucket->refill_per_ms > 0) {
+    level += bucket->refill_per_ms * (double)(now - bucket->updated_ms);
+    if (level > bucket->capacity) {
+      level = bucket->capacity;
+    }
+  }
+  return level / bucket->capacity;
+}
 
-  // Configure CURL for streaming
-  struct curl_slist *headers = chatty_create_headers(&ctx, true);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, chatty_write_stream);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&stream_ctx);
+/* The endpoint's key with the most quota left. Keys a 429 exhausted are
+   only picked when all of them are, the one that comes back first. Called
+   with the lock held. */
+static chatty_ClientKey *
+chatty_endpoint_pick_key(chatty_ClientEndpoint *endpoint, int64_t now) {
+  if (endpoint->key_count == 1) {
+    return &endpoint->keys[0];
+  }
 
-  // Perform request
-  CURLcode res = curl_easy_perform(curl);
-  long http_code = 0;
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+  chatty_ClientKey *best = NULL;
+  bool best_exhausted = false;
+  double best_headroom = 0;
+  // Start after the last pick so keys with equal headroom take turns
+  for (int i = 0; i < endpoint->key_count; i++) {
+    chatty_ClientKey *key =
+        &endpoint->keys[(endpoint->next_key + i) % endpoint->key_count];
+    chatty_Quota *quota = key->quota;
+    bool exhausted = quota->exhausted_until_ms > now;
+    double headroom;
+    if (exhausted) {
+      headroom = -(double)(quota->exhausted_until_ms - now);
+    } else {
+      headroom =
+          chatty_bucket_headroom(&quota->rate[CHATTY_RATE_REQUESTS], now);
+      double tokens_headroom =
+          chatty_bucket_headroom(&quota->rate[CHATTY_RATE_TOKENS], now);
+      if (tokens_headroom < headroom) {
+        headroom = tokens_headroom;
+      }
+    }
+    if (best == NULL || (best_exhausted && !exhausted) ||
+        (best_exhausted == exhausted && headroom > best_headroom)) {
+      best = key;
+      best_exhausted = exhausted;
+      best_headroom = headroom;
+    }
+  }
+  endpoint->next_key = (int)(best - endpoint->keys + 1) % endpoint->key_count;
+  return best;
+}
+
+/* Pick the request's API key and reserve room for one request under that
+   key's request and token limits, and return how long to hold it back.
+   Reservations queue up as debt, so concurrent callers are spread out
+   instead of bursting together when the bucket refills. Prompt tokens are
+   estimated at four bytes each. When holding it back longer than
+   min_wait_ms would take the request past its deadline, nothing is reserved
+   and -1 is returned. */
+static int64_t chatty_governor_acquire(chatty_Request *req,
+                                       int64_t min_wait_ms) {
+  int64_t now = chatty_now_ms();
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  req->key = chatty_endpoint_pick_key(req->endpoint, now);
+  int64_t wait_ms = 0;
+  if (req->client->rate_governor) {
+    chatty_Quota *quota = req->key->quota;
+    double tokens = (double)req->payload_len / 4.0;
+    wait_ms = chatty_bucket_take(&quota->rate[CHATTY_RATE_REQUESTS], 1.0, now);
+    int64_t tokens_wait_ms =
+        chatty_bucket_take(&quota->rate[CHATTY_RATE_TOKENS], tokens, now);
+    if (tokens_wait_ms > wait_ms) {
+      wait_ms = tokens_wait_ms;
+    }
+    if (quota->exhausted_until_ms - now > wait_ms) {
+      wait_ms = quota->exhausted_until_ms - now;
+    }
+    // A request that times out waiting must not keep others waiting too
+    if (wait_ms > min_wait_ms && req->deadline_ms >= 0 &&
+        now + wait_ms >= req->deadline_ms) {
+      chatty_bucket_give(&quota->rate[CHATTY_RATE_REQUESTS], 1.0);
+      chatty_bucket_give(&quota->rate[CHATTY_RATE_TOKENS], tokens);
+      wait_ms = -1;
+    }
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  return wait_ms;
+}
+
+/* The key got a 429: skip it until the provider's Retry-After, or for a
+   second when it didn't say */
+static void chatty_quota_exhaust(chatty_Quota *quota, CURL *curl) {
+  curl_off_t retry_after = 0;
+  curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+  int64_t until =
+      chatty_now_ms() + (retry_after > 0 ? (int64_t)retry_after * 1000 : 1000);
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  if (until > quota->exhausted_until_ms) {
+    quota->exhausted_until_ms = until;
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+}
+
+/* Take one of the upstream's concurrency slots if one is free */
+static bool chatty_limiter_acquire(chatty_Upstream *upstream) {
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  int limit = (int)upstream->concurrency_limit;
+  bool acquired = upstream->in_flight < (limit > 0 ? limit : 1);
+  if (acquired) {
+    upstream->in_flight++;
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  return acquired;
+}
+
+/* AIMD feedback from a finished attempt */
+static void chatty_limiter_feedback(chatty_Upstream *upstream,
+                                    bool overloaded) {
+  int64_t now = chatty_now_ms();
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  double limit = upstream->concurrency_limit;
+  if (overloaded) {
+    int64_t cooldown_ms = upstream->ttfb_p95_ms > CHATTY_CONCURRENCY_COOLDOWN_MS
+                              ? upstream->ttfb_p95_ms
+                              : CHATTY_CONCURRENCY_COOLDOWN_MS;
+    if (now - upstream->last_decrease_ms >= cooldown_ms) {
+      limit *= CHATTY_CONCURRENCY_BACKOFF;
+      upstream->last_decrease_ms = now;
+    }
+  } else if (upstream->in_flight + upstream->queued >= (int)limit) {
+    // Only grow while the limit is what holds requests back
+    limit += 1.0 / limit;
+  }
+  if (limit < 1.0) {
+    limit = 1.0;
+  } else if (limit > CHATTY_CONCURRENCY_MAX) {
+    limit = CHATTY_CONCURRENCY_MAX;
+  }
+  upstream->concurrency_limit = limit;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+}
+
+/* Whether the upstream's circuit lets a request through now, and whether
+   it would be the trial of an open circuit. Called with the lock held. */
+static bool chatty_breaker_allows(chatty_Client *client,
+                                  chatty_Upstream *upstream, int64_t now,
+                                  bool *trial) {
+  *trial = false;
+  if (!client->circuit_breaker ||
+      upstream->circuit == CHATTY_CIRCUIT_STATE_CLOSED) {
+    return true;
+  }
+  // One trial per open period, in case the last one never reported back
+  *trial = now - upstream->circuit_changed_ms >= client->breaker_open_ms;
+  return *trial;
+}
+
+/* Feed a finished attempt into the upstream's circuit breaker. Attempts
+   slower than breaker_slow_ms to their first byte count as failures. */
+static void chatty_breaker_record(chatty_Client *client,
+                                  chatty_Upstream *upstream, bool failed) {
+  if (!client->circuit_breaker) {
+    return;
+  }
+
+  int64_t now = chatty_now_ms();
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  if (upstream->breaker_count == CHATTY_BREAKER_WINDOW) {
+    upstream->breaker_failures -=
+        upstream->breaker_window[upstream->breaker_next];
+  } else {
+    upstream->breaker_count++;
+  }
+  upstream->breaker_window[upstream->breaker_next] = failed;
+  upstream->breaker_failures += failed;
+  upstream->breaker_next = (upstream->breaker_next + 1) % CHATTY_BREAKER_WINDOW;
+
+  bool open = false;
+  if (upstream->circuit == CHATTY_CIRCUIT_STATE_HALF_OPEN) {
+    open = failed;
+    if (!failed) {
+      // Recovered, judge it on what happens from here on
+      upstream->circuit = CHATTY_CIRCUIT_STATE_CLOSED;
+      upstream->breaker_count = 0;
+      upstream->breaker_next = 0;
+      upstream->breaker_failures = 0;
+    }
+  } else if (upstream->circuit == CHATTY_CIRCUIT_STATE_CLOSED) {
+    open = upstream->breaker_count >= CHATTY_BREAKER_MIN_SAMPLES &&
+           upstream->breaker_failures >=
+               client->breaker_error_rate * upstream->breaker_count;
+  }
+  if (open) {
+    upstream->circuit = CHATTY_CIRCUIT_STATE_OPEN;
+    upstream->circuit_changed_ms = now;
+    upstream->circuit_opens++;
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+}
+
+static size_t chatty_write_header(char *buffer, size_t size, size_t nitems,
+                                  void *userp) {
+  size_t len = size * nitems;
+  chatty_Request *req = (chatty_Request *)userp;
+  chatty_RateHeaders *headers = &req->rate_headers;
+
+  if (len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+    // A new response, possibly after a 100 Continue or a redirect
+    for (int kind = 0; kind < CHATTY_RATE_KINDS; kind++) {
+      headers->limit[kind] = -1;
+      headers->remaining[kind] = -1;
+      headers->reset_ms[kind] = -1;
+    }
+  } else if (len <= 2) {
+    // End of the headers
+    if (headers->remaining[CHATTY_RATE_REQUESTS] >= 0 ||
+        headers->remaining[CHATTY_RATE_TOKENS] >= 0) {
+      chatty_governor_update(req->key->quota, headers);
+    }
+  } else if (len > 12 && len < 128 &&
+             strncasecmp(buffer, "x-ratelimit-", 12) == 0) {
+    char line[128];
+    memcpy(line, buffer + 12, len - 12);
+    line[len - 12] = '\0';
+    char *value = strchr(line, ':');
+    if (value != NULL) {
+      *value++ = '\0';
+      while (*value == ' ') {
+        value++;
+      }
+      int kind = -1;
+      char *name = line;
+      char *suffix = strchr(name, '-');
+      if (suffix != NULL) {
+        *suffix++ = '\0';
+        if (strcasecmp(suffix, "requests") == 0) {
+          kind = CHATTY_RATE_REQUESTS;
+        } else if (strcasecmp(suffix, "tokens") == 0) {
+          kind = CHATTY_RATE_TOKENS;
+        }
+      }
+      if (kind >= 0 && strcasecmp(name, "limit") == 0) {
+        headers->limit[kind] = strtod(value, NULL);
+      } else if (kind >= 0 && strcasecmp(name, "remaining") == 0) {
+        headers->remaining[kind] = strtod(value, NULL);
+      } else if (kind >= 0 && strcasecmp(name, "reset") == 0) {
+        headers->reset_ms[kind] = chatty_parse_reset(value);
+      }
+    }
+  }
+  return len;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+static void chatty_hex_encode(FILE *file, const unsigned char *data,
+                              size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    fprintf(file, "%02x", data[i]);
+  }
+}
+
+/* Decodes hex in place, returns the decoded length or 0 on bad input */
+static size_t chatty_hex_decode(char *hex) {
+  size_t len = strlen(hex);
+  if (len % 2 != 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < len / 2; i++) {
+    unsigned int byte;
+    if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+      return 0;
+    }
+    hex[i] = (char)byte;
+  }
+  return len / 2;
+}
+#endif
+
+/* Host name of a URL, to be freed with curl_free() */
+static char *chatty_url_host(const char *url) {
+  char *host = NULL;
+  CURLU *u = curl_url();
+  if (u != NULL) {
+    if (curl_url_set(u, CURLUPART_URL, url, 0) != CURLUE_OK ||
+        curl_url_get(u, CURLUPART_HOST, &host, 0) != CURLUE_OK) {
+      host = NULL;
+    }
+    curl_url_cleanup(u);
+  }
+  return host;
+}
+
+/* The on-disk cache as this process last read or wrote it, so clients created
+   after the first don't go back to the disk. Kept for the lifetime of the
+   process, like the share. */
+typedef struct chatty_CacheFile {
+  char *path;
+  char *contents;         /* NULL while the file is missing or unreadable */
+  bool sessions_imported; /* Its TLS sessions are in the process-wide share */
+  struct chatty_CacheFile *next;
+} chatty_CacheFile;
+
+static chatty_CacheFile *chatty_cache_files;
+static pthread_mutex_t chatty_cache_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the record for path, reading the file on first use, or NULL if out
+   of memory. Must be called with chatty_cache_files_lock held. */
+static chatty_CacheFile *chatty_cache_file(const char *path) {
+  for (chatty_CacheFile *f = chatty_cache_files; f != NULL; f = f->next) {
+    if (strcmp(f->path, path) == 0) {
+      return f;
+    }
+  }
+
+  chatty_CacheFile *f = calloc(1, sizeof(*f));
+  if (f == NULL || (f->path = strdup(path)) == NULL) {
+    free(f);
+    return NULL;
+  }
+  FILE *file = fopen(path, "r");
+  if (file != NULL) {
+    size_t cap = 0;
+    if (getdelim(&f->contents, &cap, '\0', file) < 0) {
+      free(f->contents);
+      f->contents = NULL;
+    }
+    fclose(file);
+  }
+  f->next = chatty_cache_files;
+  chatty_cache_files = f;
+  return f;
+}
+
+/* Load the entries for the client's base URL from its on-disk cache.
+   Lines are tab separated:
+     dns <base_url> <saved unix time> <host:port:address>
+     tls <base_url> <valid until unix time> <session key|-> <hmac hex|-> <data hex>
+   A missing or unreadable cache is not an error, it is just cold. */
+static void chatty_cache_load(chatty_Client *client) {
+  // Sessions only need importing into the process-wide share once
+  pthread_mutex_lock(&chatty_cache_files_lock);
+  chatty_CacheFile *cache = chatty_cache_file(client->cache_path);
+  char *contents = cache != NULL && cache->contents != NULL
+                       ? strdup(cache->contents)
+                       : NULL;
+  bool import_sessions = client->share != NULL &&
+                         (client->share != chatty_share ||
+                          (cache != NULL && !cache->sessions_imported));
+  if (contents != NULL && client->share == chatty_share) {
+    cache->sessions_imported = true;
+  }
+  pthread_mutex_unlock(&chatty_cache_files_lock);
+  if (contents == NULL) {
+    return;
+  }
+
+  // Sessions are imported into the share through a handle attached to it
+  CURL *importer = NULL;
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  if (import_sessions) {
+    importer = curl_easy_init();
+    if (importer != NULL) {
+      curl_easy_setopt(importer, CURLOPT_SHARE, client->share);
+    }
+  }
+#else
+  (void)import_sessions;
+#endif
+
+  time_t now = time(NULL);
+  char *save_line = NULL;
+  for (char *line = strtok_r(contents, "\n", &save_line); line != NULL;
+       line = strtok_r(NULL, "\n", &save_line)) {
+    char *fields[6];
+    int field_count = 0;
+    char *rest = line;
+    while (field_count < 6 && rest != NULL) {
+      fields[field_count++] = rest;
+      rest = strchr(rest, '\t');
+      if (rest != NULL) {
+        *rest++ = '\0';
+      }
+    }
+    if (field_count < 4 || strcmp(fields[1], client->endpoints[0].ctx.base_url) != 0) {
+      continue;
+    }
+    long long stamp = strtoll(fields[2], NULL, 10);
+
+    if (strcmp(fields[0], "dns") == 0 &&
+        now - (time_t)stamp <= CHATTY_CACHE_DNS_MAX_AGE) {
+      // '+' lets the entry expire from the DNS cache like a resolved one
+      size_t entry_len = strlen(fields[3]) + 2;
+      char *entry = malloc(entry_len);
+      if (entry != NULL) {
+        snprintf(entry, entry_len, "+%s", fields[3]);
+        struct curl_slist *resolve = curl_slist_append(client->resolve, entry);
+        if (resolve != NULL) {
+          client->resolve = resolve;
+          // Kept until then, the address ages from when it was looked up
+          if (client->cache_resolved_at == 0 ||
+              (time_t)stamp < client->cache_resolved_at) {
+            client->cache_resolved_at = (time_t)stamp;
+          }
+        }
+        // "-host:port" removes it again
+        char *port_end = strchr(entry, ':');
+        port_end = port_end != NULL ? strchr(port_end + 1, ':') : NULL;
+        if (port_end != NULL) {
+          entry[0] = '-';
+          *port_end = '\0';
+          struct curl_slist *unpin = curl_slist_append(client->unpin, entry);
+          if (unpin != NULL) {
+            client->unpin = unpin;
+          }
+        }
+        free(entry);
+      }
+    } else if (strcmp(fields[0], "tls") == 0 && field_count == 6 &&
+               importer != NULL && (time_t)stamp > now) {
+#if LIBCURL_VERSION_NUM >= 0x080c00
+      const char *session_key = strcmp(fields[3], "-") == 0 ? NULL : fields[3];
+      size_t shmac_len =
+          strcmp(fields[4], "-") == 0 ? 0 : chatty_hex_decode(fields[4]);
+      size_t sdata_len = chatty_hex_decode(fields[5]);
+      if (sdata_len > 0 && (session_key != NULL || shmac_len > 0)) {
+        curl_easy_ssls_import(importer, session_key,
+                              (const unsigned char *)fields[4], shmac_len,
+                              (const unsigned char *)fields[5], sdata_len);
+      }
+#endif
+    }
+  }
+
+  free(contents);
+  if (importer != NULL) {
+    curl_easy_cleanup(importer);
+  }
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+static CURLcode chatty_cache_export_session(
+    CURL *handle, void *userptr, const char *session_key,
+    const unsigned char *shmac, size_t shmac_len, const unsigned char *sdata,
+    size_t sdata_len, curl_off_t valid_until, int ietf_tls_id,
+    const char *alpn, size_t earlydata_max) {
+  (void)handle;
+  (void)ietf_tls_id;
+  (void)alpn;
+  (void)earlydata_max;
+  chatty_CacheExport *export = (chatty_CacheExport *)userptr;
+
+  // The share holds sessions for every client in the process. Keep ours when
+  // the peer is identifiable; hashed keys can't be told apart.
+  if (session_key != NULL &&
+      (export->host == NULL || strstr(session_key, export->host) == NULL)) {
+    return CURLE_OK;
+  }
+
+  fprintf(export->file, "tls\t%s\t%lld\t%s\t", export->base_url,
+          (long long)valid_until, session_key != NULL ? session_key : "-");
+  if (shmac_len > 0) {
+    chatty_hex_encode(export->file, shmac, shmac_len);
+  } else {
+    fputc('-', export->file);
+  }
+  fputc('\t', export->file);
+  chatty_hex_encode(export->file, sdata, sdata_len);
+  fputc('\n', export->file);
+  return CURLE_OK;
+}
+#endif
+
+/* Rewrite the on-disk cache with fresh entries for the client's base URL,
+   keeping those of other base URLs. The file is replaced atomically and only
+   readable by its owner since it holds TLS session secrets. Saves are
+   serialized so clients closing on several threads don't lose each other's
+   entries. */
+static void chatty_cache_save(chatty_Client *client) {
+  const char *base_url = client->endpoints[0].ctx.base_url;
+  pthread_mutex_lock(&chatty_cache_files_lock);
+  chatty_CacheFile *cache = chatty_cache_file(client->cache_path);
+  char *contents = NULL;
+  size_t contents_len = 0;
+  FILE *out = cache != NULL ? open_memstream(&contents, &contents_len) : NULL;
+  if (out == NULL) {
+    pthread_mutex_unlock(&chatty_cache_files_lock);
+    return;
+  }
+
+  if (cache->contents != NULL) {
+    size_t base_url_len = strlen(base_url);
+    for (const char *line = cache->contents; *line != '\0';) {
+      size_t line_len = strcspn(line, "\n");
+      const char *tab = memchr(line, '\t', line_len);
+      if (tab == NULL || strncmp(tab + 1, base_url, base_url_len) != 0 ||
+          tab[1 + base_url_len] != '\t') {
+        fwrite(line, 1, line_len, out);
+        fputc('\n', out);
+      }
+      line += line_len + (line[line_len] == '\n');
+    }
+  }
+
+  char *host = chatty_url_host(base_url);
+  if (host != NULL && client->cache_addr[0] != '\0') {
+    bool ipv6 = strchr(client->cache_addr, ':') != NULL;
+    fprintf(out, "dns\t%s\t%lld\t%s:%ld:%s%s%s\n", base_url,
+            (long long)client->cache_resolved_at, host, client->cache_port,
+            ipv6 ? "[" : "",
+            client->cache_addr, ipv6 ? "]" : "");
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  // Sessions are exported from the share through a handle attached to it
+  if (client->share != NULL) {
+    CURL *exporter = curl_easy_init();
+    if (exporter != NULL) {
+      chatty_CacheExport export = {out, base_url, host};
+      curl_easy_setopt(exporter, CURLOPT_SHARE, client->share);
+      curl_easy_ssls_export(exporter, chatty_cache_export_session,
+                            (void *)&export);
+      curl_easy_cleanup(exporter);
+    }
+  }
+#endif
+
+  curl_free(host);
+  if (fclose(out) != 0) {
+    free(contents);
+    pthread_mutex_unlock(&chatty_cache_files_lock);
+    return;
+  }
+
+  // mkstemp creates the file only readable by its owner, under a name no
+  // other thread or process can be writing to
+  size_t tmp_len = strlen(client->cache_path) + sizeof(".XXXXXX");
+  char *tmp_path = malloc(tmp_len);
+  int fd = -1;
+  if (tmp_path != NULL) {
+    snprintf(tmp_path, tmp_len, "%s.XXXXXX", client->cache_path);
+    fd = mkstemp(tmp_path);
+  }
+  if (fd >= 0) {
+    size_t written = 0;
+    while (written < contents_len) {
+      ssize_t n = write(fd, contents + written, contents_len - written);
+      if (n <= 0) {
+        break;
+      }
+      written += (size_t)n;
+    }
+    if (close(fd) == 0 && written == contents_len &&
+        rename(tmp_path, client->cache_path) == 0) {
+      free(cache->contents);
+      cache->contents = contents;
+      contents = NULL;
+    } else {
+      unlink(tmp_path);
+    }
+  }
+  free(tmp_path);
+  free(contents);
+  pthread_mutex_unlock(&chatty_cache_files_lock);
+}
+
+/* Initialize and configure CURL handle with the settings that stay fixed for
+   the lifetime of a client */
+static enum chatty_ERROR chatty_setup_curl(CURL **curl,
+                                           chatty_Client *client) {
+  *curl = curl_easy_init();
+  if (!*curl) {
+    return CHATTY_CURL_INIT_ERROR;
+  }
+
+  if (client->share != NULL) {
+    curl_easy_setopt(*curl, CURLOPT_SHARE, client->share);
+  }
+  if (client->resolve != NULL && !client->unpinned) {
+    curl_easy_setopt(*curl, CURLOPT_RESOLVE, client->resolve);
+  }
+
+#ifdef CHATTY_USE_OPENSSL
+  pthread_once(&chatty_ca_once, chatty_ca_init);
+  if (chatty_ca_store != NULL &&
+      curl_easy_setopt(*curl, CURLOPT_SSL_CTX_FUNCTION, chatty_ssl_ctx_cb) ==
+          CURLE_OK) {
+    curl_easy_setopt(*curl, CURLOPT_SSL_CTX_DATA, (void *)chatty_ca_store);
+    // Nothing left for curl to read from disk
+    curl_easy_setopt(*curl, CURLOPT_CAINFO, NULL);
+    curl_easy_setopt(*curl, CURLOPT_CAPATH, NULL);
+  }
+#endif
+
+  curl_easy_setopt(*curl, CURLOPT_USERAGENT, "libchatty/1.0");
+  // Keep pooled connections alive while the client sits idle between calls
+  curl_easy_setopt(*curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+  return CHATTY_SUCCESS;
+}
+
+/* Point an easy handle at url. Over TLS, negotiate HTTP/2 and prefer
+   waiting for a stream on an existing connection over opening a new one
+   next to it. Plain HTTP, as served by local inference servers, gets a
+   connection per concurrent request instead of queuing behind one. */
+static void chatty_set_url(CURL *curl, const char *url) {
+  bool tls = strncasecmp(url, "https://", strlen("https://")) == 0;
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                   tls ? (long)CURL_HTTP_VERSION_2TLS
+                       : (long)CURL_HTTP_VERSION_1_1);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, tls ? 1L : 0L);
+}
+
+/* Create HTTP headers for the request */
+static struct curl_slist *chatty_create_headers(const char *bearer_header,
+                                                bool streaming) {
+  struct curl_slist *headers = NULL;
+  headers = curl_slist_append(headers, "Content-Type: application/json");
+  if (streaming) {
+    headers = curl_slist_append(headers, "Accept: text/event-stream");
+  } else {
+    headers = curl_slist_append(headers, "Accept: application/json");
+  }
+  headers = curl_slist_append(headers, bearer_header);
+  return headers;
+}
+
+/* Make room for extra more bytes and the terminating NUL */
+static bool chatty_buffer_reserve(chatty_Buffer *buf, size_t extra) {
+  if (buf->len + extra < buf->cap) {
+    return true;
+  }
+  size_t cap = buf->cap > 0 ? buf->cap : 256;
+  while (cap <= buf->len + extra) {
+    cap *= 2;
+  }
+  char *data = realloc(buf->data, cap);
+  if (data == NULL) {
+    return false;
+  }
+  buf->data = data;
+  buf->cap = cap;
+  return true;
+}
+
+static bool chatty_buffer_append(chatty_Buffer *buf, const char *data,
+                                 size_t len) {
+  if (!chatty_buffer_reserve(buf, len)) {
+    return false;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+  return true;
+}
+
+static bool chatty_buffer_append_str(chatty_Buffer *buf, const char *str) {
+  return chatty_buffer_append(buf, str, strlen(str));
+}
+
+/* Offset of the first byte of text that JSON needs escaped (a quote, a
+   backslash or a control character), len if there is none */
+typedef size_t (*chatty_EscapeScan)(const char *text, size_t len);
+
+static size_t chatty_escape_scan_scalar(const char *text, size_t len) {
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  size_t i = 0;
+  // Eight bytes at a time: the high bit of a lane survives where its byte
+  // is below 0x20 or, after the XOR, zero
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, text + i, 8);
+    uint64_t quote = word ^ (ones * '"');
+    uint64_t backslash = word ^ (ones * '\\');
+    uint64_t hits = ((word - ones * 0x20) & ~word) |
+                    ((quote - ones) & ~quote) |
+                    ((backslash - ones) & ~backslash);
+    if ((hits & highs) != 0) {
+      break;
+    }
+  }
+  for (; i < len; i++) {
+    unsigned char c = (unsigned char)text[i];
+    if (c < 0x20 || c == '"' || c == '\\') {
+      return i;
+    }
+  }
+  return len;
+}
+
+#ifdef CHATTY_HAVE_X86_SIMD
+static size_t chatty_escape_scan_sse2(const char *text, size_t len) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(text + i));
+    // An unsigned min with 0x1f leaves exactly the control bytes unchanged
+    __m128i special =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                                  _mm_cmpeq_epi8(chunk, backslash)),
+                     _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+    unsigned mask = (unsigned)_mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+  return i + chatty_escape_scan_scalar(text + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+chatty_escape_scan_avx2(const char *text, size_t len) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(text + i));
+    __m256i special = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                        _mm256_cmpeq_epi8(chunk, backslash)),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control), chunk));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(special);
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+  return i + chatty_escape_scan_sse2(text + i, len - i);
+}
+#endif
+
+/* Base64 of len bytes of in, padded, into out. Returns the bytes written,
+   4 for every 3 started. */
+typedef size_t (*chatty_Base64Encode)(char *out, const unsigned char *in,
+                                      size_t len);
+
+static const char chatty_base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t chatty_base64_scalar(char *out, const unsigned char *in,
+                                   size_t len) {
+  const char *alphabet = chatty_base64_alphabet;
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 3 <= len; i += 3, o += 4) {
+    uint32_t group = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8 | in[i + 2];
+    out[o] = alphabet[group >> 18];
+    out[o + 1] = alphabet[group >> 12 & 0x3f];
+    out[o + 2] = alphabet[group >> 6 & 0x3f];
+    out[o + 3] = alphabet[group & 0x3f];
+  }
+  if (i < len) {
+    uint32_t group = (uint32_t)in[i] << 16;
+    if (i + 1 < len) {
+      group |= (uint32_t)in[i + 1] << 8;
+    }
+    out[o] = alphabet[group >> 18];
+    out[o + 1] = alphabet[group >> 12 & 0x3f];
+    out[o + 2] = i + 1 < len ? alphabet[group >> 6 & 0x3f] : '=';
+    out[o + 3] = '=';
+    o += 4;
+  }
+  return o;
+}
+
+#ifdef CHATTY_HAVE_X86_SIMD
+/* 12 bytes per step, spread over 16 lanes of 6 bits and mapped to the
+   alphabet by range (W. Mula's method). Reads 16 bytes, so the last
+   partial steps are left to the scalar encoder. */
+__attribute__((target("ssse3"))) static size_t
+chatty_base64_ssse3(char *out, const unsigned char *in, size_t len) {
+  const __m128i spread =
+      _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i shifts = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 16 <= len; i += 12, o += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(in + i));
+    bytes = _mm_shuffle_epi8(bytes, spread);
+    // Move each 6-bit group to the bottom of its own byte
+    __m128i high = _mm_mulhi_epu16(
+        _mm_and_si128(bytes, _mm_set1_epi32(0x0fc0fc00)),
+        _mm_set1_epi32(0x04000040));
+    __m128i low = _mm_mullo_epi16(
+        _mm_and_si128(bytes, _mm_set1_epi32(0x003f03f0)),
+        _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(high, low);
+    // 0-25 pick shift 13, 26-51 shift 0, 52-63 shifts 1 to 12
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    __m128i chars = _mm_add_epi8(_mm_shuffle_epi8(shifts, range), indices);
+    _mm_storeu_si128((__m128i *)(out + o), chars);
+  }
+  return o + chatty_base64_scalar(out + o, in + i, len - i);
+}
+
+/* The same with 24 bytes per step, 12 in each 128-bit lane */
+__attribute__((target("avx2"))) static size_t
+chatty_base64_avx2(char *out, const unsigned char *in, size_t len) {
+  const __m256i spread = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5,
+      4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i shifts = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+  size_t o = 0;
+  for (; i + 28 <= len; i += 24, o += 32) {
+    __m256i bytes = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + i))),
+        _mm_loadu_si128((const __m128i *)(in + i + 12)), 1);
+    bytes = _mm256_shuffle_epi8(bytes, spread);
+    __m256i high = _mm256_mulhi_epu16(
+        _mm256_and_si256(bytes, _mm256_set1_epi32(0x0fc0fc00)),
+        _mm256_set1_epi32(0x04000040));
+    __m256i low = _mm256_mullo_epi16(
+        _mm256_and_si256(bytes, _mm256_set1_epi32(0x003f03f0)),
+        _mm256_set1_epi32(0x01000010));
+    __m256i indices = _mm256_or_si256(high, low);
+    __m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    range =
+        _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    __m256i chars =
+        _mm256_add_epi8(_mm256_shuffle_epi8(shifts, range), indices);
+    _mm256_storeu_si256((__m256i *)(out + o), chars);
+  }
+  return o + chatty_base64_ssse3(out + o, in + i, len - i);
+}
+#endif
+
+static chatty_EscapeScan chatty_escape_scan = chatty_escape_scan_scalar;
+static chatty_Base64Encode chatty_base64 = chatty_base64_scalar;
+static pthread_once_t chatty_simd_once = PTHREAD_ONCE_INIT;
+
+/* Pick the widest routines this CPU runs. SSE2 is part of x86-64. */
+static void chatty_simd_init(void) {
+#ifdef CHATTY_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    chatty_escape_scan = chatty_escape_scan_avx2;
+    chatty_base64 = chatty_base64_avx2;
+  } else {
+    chatty_escape_scan = chatty_escape_scan_sse2;
+    if (__builtin_cpu_supports("ssse3")) {
+      chatty_base64 = chatty_base64_ssse3;
+    }
+  }
+#endif
+}
+
+/* Bytes that c, found by chatty_escape_scan(), takes once escaped */
+static size_t chatty_escape_width(unsigned char c) {
+  switch (c) {
+  case '"':
+  case '\\':
+  case '\b':
+  case '\f':
+  case '\n':
+  case '\r':
+  case '\t':
+    return 2;
+  default:
+    return 6; // \u00XX
+  }
+}
+
+/* Append the inside of a JSON string. Runs of bytes that need no escaping,
+   which is nearly all of a prompt, are found 16 or 32 bytes at a time where
+   the CPU allows and copied in one go. UTF-8 passes through. */
+static bool chatty_buffer_append_escaped(chatty_Buffer *buf, const char *text,
+                                         size_t len) {
+  pthread_once(&chatty_simd_once, chatty_simd_init);
+  if (!chatty_buffer_reserve(buf, len)) {
+    return false;
+  }
+
+  size_t run = 0;
+  while (run < len) {
+    size_t i = run + chatty_escape_scan(text + run, len - run);
+    size_t escape_len =
+        i < len ? chatty_escape_width((unsigned char)text[i]) : 0;
+    if (!chatty_buffer_reserve(buf, i - run + escape_len)) {
+      return false;
+    }
+    memcpy(buf->data + buf->len, text + run, i - run);
+    buf->len += i - run;
+    if (i == len) {
+      break;
+    }
+    unsigned char c = (unsigned char)text[i];
+    char *out = buf->data + buf->len;
+    out[0] = '\\';
+    out[1] = (char)c;
+    buf->len += escape_len;
+    switch (c) {
+    case '"':
+    case '\\':
+      break;
+    case '\b':
+      out[1] = 'b';
+      break;
+    case '\f':
+      out[1] = 'f';
+      break;
+    case '\n':
+      out[1] = 'n';
+      break;
+    case '\r':
+      out[1] = 'r';
+      break;
+    case '\t':
+      out[1] = 't';
+      break;
+    default:
+      memcpy(out + 1, "u00", 3);
+      out[4] = "0123456789abcdef"[c >> 4];
+      out[5] = "0123456789abcdef"[c & 0xf];
+    }
+    run = i + 1;
+  }
+  buf->data[buf->len] = '\0';
+  return true;
+}
+
+/* Length of text once escaped by chatty_buffer_append_escaped() */
+static size_t chatty_escaped_len(const char *text, size_t len) {
+  pthread_once(&chatty_simd_once, chatty_simd_init);
+  size_t escaped_len = len;
+  size_t run = 0;
+  while (run < len) {
+    size_t i = run + chatty_escape_scan(text + run, len - run);
+    if (i == len) {
+      break;
+    }
+    escaped_len += chatty_escape_width((unsigned char)text[i]) - 1;
+    run = i + 1;
+  }
+  return escaped_len;
+}
+
+static bool chatty_buffer_append_json_string(chatty_Buffer *buf,
+                                             const char *text, size_t len) {
+  return chatty_buffer_append(buf, "\"", 1) &&
+         chatty_buffer_append_escaped(buf, text, len) &&
+         chatty_buffer_append(buf, "\"", 1);
+}
+
+static bool chatty_buffer_append_number(chatty_Buffer *buf, double number) {
+  // Like cJSON: 15 digits unless that doesn't read back as the same double
+  char text[32];
+  int len = snprintf(text, sizeof(text), "%1.15g", number);
+  if (strtod(text, NULL) != number) {
+    len = snprintf(text, sizeof(text), "%1.17g", number);
+  }
+  // printf follows LC_NUMERIC, JSON always wants a '.'
+  char decimal_point = localeconv()->decimal_point[0];
+  char *point = decimal_point != '.' && decimal_point != '\0'
+                    ? strchr(text, decimal_point)
+                    : NULL;
+  if (point != NULL) {
+    *point = '.';
+  }
+  return chatty_buffer_append(buf, text, (size_t)len);
+}
+
+/* The text of a message as segments: its iov, or one segment filled in
+   from message and its length */
+static const struct iovec *chatty_message_text(const chatty_Message *message,
+                                               struct iovec *one, int *count) {
+  if (message->iov != NULL) {
+    *count = message->iovcnt;
+    return message->iov;
+  }
+  one->iov_base = message->message;
+  one->iov_len =
+      message->has_length ? message->length : strlen(message->message);
+  *count = 1;
+  return one;
+}
+
+static size_t chatty_message_len(const chatty_Message *message) {
+  struct iovec one;
+  int count;
+  const struct iovec *iov = chatty_message_text(message, &one, &count);
+  size_t len = 0;
+  for (int i = 0; i < count; i++) {
+    len += iov[i].iov_len;
+  }
+  return len;
+}
+
+/* Size of the file an image is read from */
+static enum chatty_ERROR chatty_image_size(const chatty_Image *image,
+                                           size_t *size) {
+  struct stat info;
+  int failed = image->path != NULL ? stat(image->path, &info)
+                                   : fstat(image->fd, &info);
+  if (failed != 0 || !S_ISREG(info.st_mode)) {
+    return CHATTY_FILE_ERROR;
+  }
+  *size = (size_t)info.st_size;
+  return CHATTY_SUCCESS;
+}
+
+static enum chatty_ERROR chatty_image_map(const chatty_Image *image,
+                                          chatty_Mapping *map) {
+  int fd = image->path != NULL ? open(image->path, O_RDONLY | O_CLOEXEC)
+                               : image->fd;
+  if (fd < 0) {
+    return CHATTY_FILE_ERROR;
+  }
+  struct stat info;
+  enum chatty_ERROR error = CHATTY_SUCCESS;
+  map->data = NULL;
+  map->len = 0;
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    error = CHATTY_FILE_ERROR;
+  } else if (info.st_size > 0) {
+    void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      error = CHATTY_FILE_ERROR;
+    } else {
+      // Read once front to back, and only by the encoder
+      posix_madvise(data, (size_t)info.st_size, POSIX_MADV_SEQUENTIAL);
+      map->data = data;
+      map->len = (size_t)info.st_size;
+    }
+  }
+  if (image->path != NULL) {
+    close(fd); // The mapping stays valid
+  }
+  return error;
+}
+
+static void chatty_image_unmap(chatty_Mapping *map) {
+  if (map->data != NULL) {
+    munmap((void *)map->data, map->len);
+  }
+  map->data = NULL;
+  map->len = 0;
+}
+
+/* Append the base64 of len bytes. Only the last piece of a file may have a
+   length that is not a multiple of 3. */
+static bool chatty_buffer_append_base64(chatty_Buffer *buf,
+                                        const unsigned char *data,
+                                        size_t len) {
+  pthread_once(&chatty_simd_once, chatty_simd_init);
+  if (!chatty_buffer_reserve(buf, (len + 2) / 3 * 4)) {
+    return false;
+  }
+  buf->len += chatty_base64(buf->data + buf->len, data, len);
+  buf->data[buf->len] = '\0';
+  return true;
+}
+
+/* A message with images has an array of parts as its content. Its text is
+   the first part, unless it is empty. */
+static bool chatty_message_has_text_part(const chatty_Message *message) {
+  return message->image_count == 0 || chatty_message_len(message) > 0;
+}
+
+/* The JSON of message index up to where its text goes */
+static bool chatty_write_message_open(chatty_Buffer *out, int index,
+                                      const chatty_Message *message,
+                                      bool text_part) {
+  bool ok = (index == 0 || chatty_buffer_append_str(out, ",")) &&
+            chatty_buffer_append_str(out, "{\"role\":\"") &&
+            chatty_buffer_append_str(out, chatty_role_name(message->role)) &&
+            chatty_buffer_append_str(out, "\",\"content\":");
+  if (message->image_count == 0) {
+    return ok && chatty_buffer_append_str(out, "\"");
+  }
+  return ok && chatty_buffer_append_str(out, "[") &&
+         (!text_part ||
+          chatty_buffer_append_str(out, "{\"type\":\"text\",\"text\":\""));
+}
+
+/* The JSON after a message's text, before its first image if any */
+static bool chatty_write_text_close(chatty_Buffer *out,
+                                    const chatty_Message *message,
+                                    bool text_part) {
+  if (message->image_count == 0) {
+    return chatty_buffer_append_str(out, "\"");
+  }
+  return !text_part || chatty_buffer_append_str(out, "\"}");
+}
+
+/* The JSON of image index of a message up to its base64 data */
+static bool chatty_write_image_open(chatty_Buffer *out,
+                                    const chatty_Message *message, int index,
+                                    bool text_part) {
+  const char *mime_type = chatty_image_mime_type(&message->images[index]);
+  return ((index == 0 && !text_part) || chatty_buffer_append_str(out, ",")) &&
+         chatty_buffer_append_str(
+             out, "{\"type\":\"image_url\",\"image_url\":{\"url\":\"data:") &&
+         chatty_buffer_append_escaped(out, mime_type, strlen(mime_type)) &&
+         chatty_buffer_append_str(out, ";base64,");
+}
+
+static bool chatty_write_image_close(chatty_Buffer *out) {
+  return chatty_buffer_append_str(out, "\"}}");
+}
+
+static bool chatty_write_message_close(chatty_Buffer *out,
+                                       const chatty_Message *message) {
+  return chatty_buffer_append_str(out, message->image_count > 0 ? "]}" : "}");
+}
+
+/* Message index as a JSON object, with its images encoded in place */
+static enum chatty_ERROR chatty_write_message(chatty_Buffer *out, int index,
+                                              const chatty_Message *message) {
+  bool text_part = chatty_message_has_text_part(message);
+  struct iovec one;
+  int count;
+  const struct iovec *iov = chatty_message_text(message, &one, &count);
+  bool ok = chatty_write_message_open(out, index, message, text_part);
+  for (int i = 0; i < count && ok; i++) {
+    ok = chatty_buffer_append_escaped(out, iov[i].iov_base, iov[i].iov_len);
+  }
+  ok = ok && chatty_write_text_close(out, message, text_part);
+  for (int i = 0; i < message->image_count && ok; i++) {
+    chatty_Mapping map;
+    enum chatty_ERROR error = chatty_image_map(&message->images[i], &map);
+    if (error != CHATTY_SUCCESS) {
+      return error;
+    }
+    ok = chatty_write_image_open(out, message, i, text_part) &&
+         chatty_buffer_append_base64(out, map.data, map.len) &&
+         chatty_write_image_close(out);
+    chatty_image_unmap(&map);
+  }
+  ok = ok && chatty_write_message_close(out, message);
+  return ok ? CHATTY_SUCCESS : CHATTY_MEMORY_ERROR;
+}
+
+/* Size of what chatty_write_message() writes, found without reading the
+   images. Their sizes come from maps when the images are already mapped, so
+   the length matches what gets encoded even if a file changes meanwhile.
+   scratch is overwritten. */
+static enum chatty_ERROR chatty_measure_message(chatty_Buffer *scratch,
+                                                int index,
+                                                const chatty_Message *message,
+                                                const chatty_Mapping *maps,
+                                                size_t *len) {
+  bool text_part = chatty_message_has_text_part(message);
+  scratch->len = 0;
+  bool ok = chatty_write_message_open(scratch, index, message, text_part) &&
+            chatty_write_text_close(scratch, message, text_part) &&
+            chatty_write_message_close(scratch, message);
+  for (int i = 0; i < message->image_count && ok; i++) {
+    size_t size;
+    if (maps != NULL) {
+      size = maps[i].len;
+    } else {
+      enum chatty_ERROR error = chatty_image_size(&message->images[i], &size);
+      if (error != CHATTY_SUCCESS) {
+        return error;
+      }
+    }
+    *len += (size + 2) / 3 * 4;
+    ok = chatty_write_image_open(scratch, message, i, text_part) &&
+         chatty_write_image_close(scratch);
+  }
+  if (!ok) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  *len += scratch->len;
+  struct iovec one;
+  int count;
+  const struct iovec *iov = chatty_message_text(message, &one, &count);
+  for (int i = 0; i < count; i++) {
+    *len += chatty_escaped_len(iov[i].iov_base, iov[i].iov_len);
+  }
+  return CHATTY_SUCCESS;
+}
+
+/* Bytes of text and images in a message, before any encoding */
+static size_t chatty_message_size(const chatty_Message *message) {
+  size_t size = chatty_message_len(message);
+  for (int i = 0; i < message->image_count; i++) {
+    size_t image_size;
+    if (chatty_image_size(&message->images[i], &image_size) == CHATTY_SUCCESS) {
+      size += image_size;
+    }
+  }
+  return size;
+}
+
+/* Messages from index on, each as a JSON object */
+static enum chatty_ERROR chatty_write_messages(chatty_Buffer *out, int index,
+                                               int msgc,
+                                               const chatty_Message msgv[]) {
+  for (int i = 0; i < msgc; i++) {
+    enum chatty_ERROR error = chatty_write_message(out, index + i, &msgv[i]);
+    if (error != CHATTY_SUCCESS) {
+      return error;
+    }
+  }
+  return CHATTY_SUCCESS;
+}
+
+/* Length of what chatty_write_head() writes */
+static size_t chatty_head_len(const chatty_Options *options) {
+  const chatty_Template *request_template = options->request_template;
+  size_t len = request_template != NULL ? request_template->head_len
+                                        : strlen("{\"messages\":[");
+  const chatty_Turn *turn =
+      options->conversation != NULL ? options->conversation->last : NULL;
+  if (turn != NULL) {
+    len += turn->start + turn->len;
+    if (request_template != NULL && request_template->count > 0) {
+      len += 1;
+    }
+  }
+  return len;
+}
+
+/* The JSON before the first message of msgv: the opening with the
+   template's messages, then the conversation's history, each turn copied
+   to where it goes */
+static bool chatty_write_head(chatty_Buffer *out,
+                              const chatty_Options *options) {
+  const chatty_Template *request_template = options->request_template;
+  bool ok = request_template != NULL
+                ? chatty_buffer_append(out, request_template->json.data,
+                                       request_template->head_len)
+                : chatty_buffer_append_str(out, "{\"messages\":[");
+  const chatty_Turn *turn =
+      options->conversation != NULL ? options->conversation->last : NULL;
+  if (!ok || turn == NULL) {
+    return ok;
+  }
+  if (request_template != NULL && request_template->count > 0 &&
+      !chatty_buffer_append_str(out, ",")) {
+    return false;
+  }
+  size_t len = turn->start + turn->len;
+  if (!chatty_buffer_reserve(out, len)) {
+    return false;
+  }
+  char *history = out->data + out->len;
+  for (; turn != NULL; turn = turn->parent) {
+    memcpy(history + turn->start, turn->json, turn->len);
+    if (turn->start > 0) {
+      history[turn->start - 1] = ',';
+    }
+  }
+  out->len += len;
+  out->data[out->len] = '\0';
+  return true;
+}
+
+/* The sampling parameters that are set, each led by a comma */
+static bool chatty_write_sampling(chatty_Buffer *out,
+                                  const chatty_Options *options) {
+  bool ok = true;
+  if (options->has_temperature) {
+    ok = chatty_buffer_append_str(out, ",\"temperature\":") &&
+         chatty_buffer_append_number(out, options->temperature);
+  }
+  if (options->has_top_p) {
+    ok = ok && chatty_buffer_append_str(out, ",\"top_p\":") &&
+         chatty_buffer_append_number(out, options->top_p);
+  }
+  return ok;
+}
+
+/* The JSON after the last message. A model in options, such as an
+   endpoint's own name for it, replaces the template's. */
+static bool chatty_write_tail(chatty_Buffer *out, const chatty_Options *options,
+                              bool stream) {
+  const chatty_Template *request_template = options->request_template;
+  bool ok = chatty_buffer_append_str(out, "],\"model\":");
+  const char *model = chatty_options_model(options);
+  if (model != NULL) {
+    ok = ok && chatty_buffer_append_json_string(out, model, strlen(model));
+  } else {
+    ok = ok && chatty_buffer_append(
+                   out, request_template->json.data + request_template->head_len,
+                   request_template->model_len);
+  }
+  if (request_template != NULL) {
+    ok = ok && chatty_buffer_append(out,
+                                    request_template->json.data +
+                                        request_template->head_len +
+                                        request_template->model_len,
+                                    request_template->tail_len);
+  } else {
+    ok = ok && chatty_write_sampling(out, options);
+  }
+  if (stream) {
+    ok = ok && chatty_buffer_append_str(out, ",\"stream\":true");
+  }
+  return ok && chatty_buffer_append_str(out, "}");
+}
+
+/* Serialize a chat completion request into out as compact JSON, replacing
+   what it held, in a single pass over the messages */
+static enum chatty_ERROR chatty_write_payload(chatty_Buffer *out, int msgc,
+                                              chatty_Message msgv[],
+                                              const chatty_Options *options,
+                                              bool stream) {
+  if (chatty_options_model(options) == NULL &&
+      options->request_template == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+  for (int i = 0; i < msgc; i++) {
+    if (chatty_role_name(msgv[i].role) == NULL) {
+      return CHATTY_INVALID_OPTIONS;
+    }
+  }
+
+  out->len = 0;
+  if (!chatty_write_head(out, options)) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  enum chatty_ERROR error =
+      chatty_write_messages(out, chatty_leading_count(options), msgc, msgv);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+  return chatty_write_tail(out, options, stream) ? CHATTY_SUCCESS
+                                                 : CHATTY_MEMORY_ERROR;
+}
+
+/* Size in bytes of what chatty_write_payload() would produce, found without
+   writing the messages' text or reading their images. maps holds every
+   image of msgv in order, or is NULL to look their sizes up. scratch is
+   overwritten. */
+static enum chatty_ERROR chatty_measure_payload(chatty_Buffer *scratch,
+                                                int msgc, chatty_Message msgv[],
+                                                const chatty_Mapping *maps,
+                                                const chatty_Options *options,
+                                                bool stream, size_t *len) {
+  if (chatty_options_model(options) == NULL &&
+      options->request_template == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  int leading = chatty_leading_count(options);
+  *len = chatty_head_len(options);
+  for (int i = 0; i < msgc; i++) {
+    if (chatty_role_name(msgv[i].role) == NULL) {
+      return CHATTY_INVALID_OPTIONS;
+    }
+    enum chatty_ERROR error =
+        chatty_measure_message(scratch, leading + i, &msgv[i], maps, len);
+    if (error != CHATTY_SUCCESS) {
+      return error;
+    }
+    if (maps != NULL) {
+      maps += msgv[i].image_count;
+    }
+  }
+  scratch->len = 0;
+  if (!chatty_write_tail(scratch, options, stream)) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  *len += scratch->len;
+  return CHATTY_SUCCESS;
+}
+
+char *chatty_to_json_string(int msgc, chatty_Message msgv[],
+                            chatty_Options options, bool stream) {
+  chatty_Buffer out = {NULL, 0, 0};
+  if (chatty_write_payload(&out, msgc, msgv, &options, stream) !=
+      CHATTY_SUCCESS) {
+    free(out.data);
+    return NULL;
+  }
+  return out.data;
+}
+
+/* Move a lazily written body on to message index, writing its opening */
+static bool chatty_body_open_message(chatty_Request *req, int index) {
+  const chatty_Message *message = &req->msgv[index];
+  req->read_step = CHATTY_BODY_CONTENT;
+  req->read_message = index;
+  req->read_iov =
+      chatty_message_text(message, &req->read_one, &req->read_iovcnt);
+  req->read_segment = 0;
+  req->read_offset = 0;
+  req->read_text_part = chatty_message_has_text_part(message);
+  return chatty_write_message_open(
+      &req->body, chatty_leading_count(&req->options) + index, message,
+      req->read_text_part);
+}
+
+/* Move on to image index of the current message, writing its opening */
+static bool chatty_body_open_image(chatty_Request *req, int index) {
+  const chatty_Message *message = &req->msgv[req->read_message];
+  req->read_step = CHATTY_BODY_IMAGE;
+  req->read_image = index;
+  req->read_map++;
+  req->read_offset = 0;
+  return chatty_write_image_open(&req->body, message, index,
+                                 req->read_text_part);
+}
+
+/* Close the current message and open the next, or move on to the end */
+static bool chatty_body_close_message(chatty_Request *req) {
+  if (!chatty_write_message_close(&req->body, &req->msgv[req->read_message])) {
+    return false;
+  }
+  if (req->read_message + 1 == req->msgc) {
+    req->read_step = CHATTY_BODY_TAIL;
+    return true;
+  }
+  return chatty_body_open_message(req, req->read_message + 1);
+}
+
+/* Write the next piece of a lazily written body into req->body: an
+   opening, up to CHATTY_BODY_CHUNK bytes of a message's text or of an
+   image's base64, or the end */
+static bool chatty_body_refill(chatty_Request *req) {
+  chatty_Buffer *out = &req->body;
+  const chatty_Message *message = NULL;
+  out->len = 0;
+  req->body_pos = 0;
+  switch (req->read_step) {
+  case CHATTY_BODY_HEAD:
+    // The history is already serialized and held by the conversation
+    req->read_map = -1;
+    return chatty_write_head(out, &req->options) &&
+           chatty_body_open_message(req, 0);
+  case CHATTY_BODY_CONTENT:
+    while (req->read_segment < req->read_iovcnt) {
+      const struct iovec *segment = &req->read_iov[req->read_segment];
+      size_t len = segment->iov_len - req->read_offset;
+      if (len == 0) {
+        req->read_segment++;
+        req->read_offset = 0;
+        continue;
+      }
+      if (len > CHATTY_BODY_CHUNK) {
+        len = CHATTY_BODY_CHUNK;
+      }
+      const char *text = (const char *)segment->iov_base + req->read_offset;
+      req->read_offset += len;
+      return chatty_buffer_append_escaped(out, text, len);
+    }
+    message = &req->msgv[req->read_message];
+    if (!chatty_write_text_close(out, message, req->read_text_part)) {
+      return false;
+    }
+    return message->image_count > 0 ? chatty_body_open_image(req, 0)
+                                    : chatty_body_close_message(req);
+  case CHATTY_BODY_IMAGE:
+    if (req->read_offset < req->maps[req->read_map].len) {
+      // Whole groups of 3 bytes, so no padding until the end of the file
+      const chatty_Mapping *map = &req->maps[req->read_map];
+      size_t len = map->len - req->read_offset;
+      if (len > CHATTY_BODY_CHUNK / 4 * 3) {
+        len = CHATTY_BODY_CHUNK / 4 * 3;
+      }
+      const unsigned char *data = map->data + req->read_offset;
+      req->read_offset += len;
+      return chatty_buffer_append_base64(out, data, len);
+    }
+    message = &req->msgv[req->read_message];
+    if (!chatty_write_image_close(out)) {
+      return false;
+    }
+    return req->read_image + 1 < message->image_count
+               ? chatty_body_open_image(req, req->read_image + 1)
+               : chatty_body_close_message(req);
+  case CHATTY_BODY_TAIL:
+    req->read_step = CHATTY_BODY_DONE;
+    return chatty_write_tail(out, &req->options, req->streaming);
+  case CHATTY_BODY_DONE:
+    break;
+  }
+  return true;
+}
+
+/* Map every image of a lazily written body up front, so a file that can't
+   be read fails the request before any of it is sent */
+static enum chatty_ERROR chatty_request_map_images(chatty_Request *req) {
+  int count = 0;
+  for (int i = 0; i < req->msgc; i++) {
+    count += req->msgv[i].image_count;
+  }
+  if (count == 0) {
+    return CHATTY_SUCCESS;
+  }
+  req->maps = calloc((size_t)count, sizeof(chatty_Mapping));
+  if (req->maps == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  for (int i = 0; i < req->msgc; i++) {
+    for (int j = 0; j < req->msgv[i].image_count; j++) {
+      enum chatty_ERROR error = chatty_image_map(&req->msgv[i].images[j],
+                                                 &req->maps[req->map_count]);
+      if (error != CHATTY_SUCCESS) {
+        return error; // The caller unmaps what was mapped
+      }
+      req->map_count++;
+    }
+  }
+  return CHATTY_SUCCESS;
+}
+
+static void chatty_request_unmap_images(chatty_Request *req) {
+  for (int i = 0; i < req->map_count; i++) {
+    chatty_image_unmap(&req->maps[i]);
+  }
+  free(req->maps);
+  req->maps = NULL;
+  req->map_count = 0;
+}
+
+/* Hand curl the next bytes of a lazily written body, so only one chunk of
+   it is ever held in memory */
+static size_t chatty_read_body(char *buffer, size_t size, size_t nitems,
+                               void *userp) {
+  chatty_Request *req = (chatty_Request *)userp;
+  size_t room = size * nitems;
+  size_t written = 0;
+  while (written < room) {
+    if (req->body_pos == req->body.len) {
+      if (req->read_step == CHATTY_BODY_DONE) {
+        break;
+      }
+      if (!chatty_body_refill(req)) {
+        req->body_error = CHATTY_MEMORY_ERROR;
+        return CURL_READFUNC_ABORT;
+      }
+      continue;
+    }
+    size_t len = req->body.len - req->body_pos;
+    if (len > room - written) {
+      len = room - written;
+    }
+    memcpy(buffer + written, req->body.data + req->body_pos, len);
+    req->body_pos += len;
+    written += len;
+  }
+  return written;
+}
+
+/* Start a lazily written body over, for curl resending it on a new
+   connection */
+static int chatty_seek_body(void *userp, curl_off_t offset, int origin) {
+  chatty_Request *req = (chatty_Request *)userp;
+  if (offset != 0 || origin != SEEK_SET) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  req->read_step = CHATTY_BODY_HEAD;
+  req->body_error = CHATTY_SUCCESS;
+  req->body.len = 0;
+  req->body_pos = 0;
+  return CURL_SEEKFUNC_OK;
+}
+
+/* Parse a non-streaming chat completion body into response */
+static enum chatty_ERROR chatty_parse_response(const char *body,
+                                               chatty_Message *response) {
+  bool json_parse_fail = false;
+  cJSON *response_json = cJSON_Parse(body);
+  if (response_json == NULL) {
+    json_parse_fail = true;
+    goto parse_end;
+  }
+  cJSON *choices = cJSON_GetObjectItemCaseSensitive(response_json, "choices");
+  if (choices == NULL || cJSON_GetArraySize(choices) == 0) {
+    json_parse_fail = true;
+    goto parse_end;
+  }
+  cJSON *choice = cJSON_GetArrayItem(choices, 0);
+  if (choice == NULL) {
+    json_parse_fail = true;
+    goto parse_end;
+  }
+  cJSON *message = cJSON_GetObjectItemCaseSensitive(choice, "message");
+  if (message == NULL) {
+    json_parse_fail = true;
+    goto parse_end;
+  }
+  cJSON *role = cJSON_GetObjectItemCaseSensitive(message, "role");
+  if (role == NULL) {
+    json_parse_fail = true;
+    goto parse_end;
+  }
+  enum chatty_Role role_enum = chatty_role_from_json(role);
+  if (role_enum == -1) {
+    json_parse_fail = true;
+    goto parse_end;
+  }
+  cJSON *content = cJSON_GetObjectItemCaseSensitive(message, "content");
+  if (content == NULL) {
+    json_parse_fail = true;
+    goto parse_end;
+  }
+
+parse_end:
+  if (!json_parse_fail) {
+    response->role = role_enum;
+    response->message = strdup(content->valuestring);
+    if (response->message == NULL) {
+      cJSON_Delete(response_json);
+      return CHATTY_MEMORY_ERROR;
+    }
+    response->has_length = true;
+    response->length = strlen(response->message);
+    response->iov = NULL;
+    response->iovcnt = 0;
+    response->images = NULL;
+    response->image_count = 0;
+  }
+
+  cJSON_Delete(response_json); // Works even if response_json is NULL
+
+  if (json_parse_fail) {
+    return CHATTY_JSON_PARSE_ERROR;
+  }
+  return CHATTY_SUCCESS;
+}
+
+/* Point a request's easy handle at its payload and response sink */
+static void chatty_request_bind(chatty_Request *req) {
+  chatty_Client *client = req->client;
+  chatty_ClientEndpoint *endpoint = req->endpoint;
+  CURL *curl = req->curl;
+
+  chatty_set_url(curl, endpoint->ctx.chat_url);
+  if (req->msgv != NULL) {
+    chatty_seek_body((void *)req, 0, SEEK_SET);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (void *)NULL);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, chatty_read_body);
+    curl_easy_setopt(curl, CURLOPT_READDATA, (void *)req);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, chatty_seek_body);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, (void *)req);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->payload);
+  }
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                   (curl_off_t)req->payload_len);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)req);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER,
+                   req->streaming ? req->key->stream_headers
+                                  : req->key->json_headers);
+  // Each attempt gets what is left of the request's deadline
+  long timeout_ms = 0;
+  if (req->deadline_ms >= 0) {
+    int64_t left = req->deadline_ms - chatty_now_ms();
+    timeout_ms = left > 1 ? (long)left : 1;
+  }
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, req->connect_timeout_ms);
+  if (client->rate_governor) {
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, chatty_write_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)req);
+  }
+  if (req->cancel != NULL) {
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, chatty_xferinfo);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)req->cancel);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+  }
+  if (client->hedge_delay_ms != 0) {
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, chatty_write_hedged);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)req);
+  } else if (req->streaming) {
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, chatty_write_stream);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&req->stream_ctx);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, chatty_write_memory);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&req->chunk);
+  }
+}
+
+/* Schedule a duplicate of the request for when it has waited too long for
+   its first byte: after hedge_delay_ms, or the upstream's p95 */
+static void chatty_hedge_arm(chatty_Request *req) {
+  chatty_Client *client = req->client;
+  req->hedge_at_ms = -1;
+  // A duplicate of a lazily written body would upload it all a second time
+  if (client->hedge_delay_ms == 0 || req->msgv != NULL) {
+    return;
+  }
+
+  int64_t delay_ms = client->hedge_delay_ms;
+  if (delay_ms < 0) {
+    pthread_mutex_lock(&chatty_upstreams_lock);
+    delay_ms = req->endpoint->upstream->ttfb_p95_ms;
+    pthread_mutex_unlock(&chatty_upstreams_lock);
+  }
+  if (delay_ms >= 0) {
+    req->hedge_at_ms = chatty_now_ms() + delay_ms;
+  }
+}
+
+/* Whether the request's deadline passes within delay_ms from now */
+static bool chatty_request_out_of_time(const chatty_Request *req,
+                                       int64_t delay_ms) {
+  return req->deadline_ms >= 0 &&
+         chatty_now_ms() + delay_ms >= req->deadline_ms;
+}
+
+/* Whether a request may go out now under the adaptive concurrency limit.
+   Requests already waiting go first. */
+static bool chatty_request_admit(chatty_Request *req) {
+  chatty_Client *client = req->client;
+  if (!client->adaptive_concurrency || req->has_slot || req->probe) {
+    return true;
+  }
+  chatty_ClientEndpoint *endpoint = req->endpoint;
+  if (endpoint->queue_head != NULL ||
+      !chatty_limiter_acquire(endpoint->upstream)) {
+    return false;
+  }
+  req->has_slot = true;
+  return true;
+}
+
+static void chatty_request_enqueue(chatty_Request *req) {
+  chatty_ClientEndpoint *endpoint = req->endpoint;
+  req->queued = true;
+  req->queue_next = NULL;
+  if (endpoint->queue_tail != NULL) {
+    endpoint->queue_tail->queue_next = req;
+  } else {
+    endpoint->queue_head = req;
+  }
+  endpoint->queue_tail = req;
+  req->client->queued++;
+
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  endpoint->upstream->queued++;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+}
+
+static void chatty_request_dequeue(chatty_Request *req) {
+  chatty_ClientEndpoint *endpoint = req->endpoint;
+  chatty_Request *prev = NULL;
+  for (chatty_Request *it = endpoint->queue_head; it != req;
+       it = it->queue_next) {
+    prev = it;
+  }
+  if (prev != NULL) {
+    prev->queue_next = req->queue_next;
+  } else {
+    endpoint->queue_head = req->queue_next;
+  }
+  if (endpoint->queue_tail == req) {
+    endpoint->queue_tail = prev;
+  }
+  req->queued = false;
+  req->queue_next = NULL;
+  req->client->queued--;
+
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  endpoint->upstream->queued--;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+}
+
+/* Give back the request's concurrency slot, if it holds one */
+static void chatty_request_release(chatty_Request *req) {
+  if (req->has_slot) {
+    pthread_mutex_lock(&chatty_upstreams_lock);
+    req->endpoint->upstream->in_flight--;
+    pthread_mutex_unlock(&chatty_upstreams_lock);
+    req->has_slot = false;
+  }
+}
+
+/* Add a prepared request to the active list, and to the multi handle once
+   delay_ms has passed and the concurrency limit lets it through */
+static enum chatty_ERROR chatty_client_launch(chatty_Client *client,
+                                              chatty_Request *req,
+                                              int64_t delay_ms) {
+  req->parked = delay_ms > 0;
+  req->queued = false;
+  if (req->parked) {
+    req->wake_at_ms = chatty_now_ms() + delay_ms;
+    client->parked++;
+  } else if (!chatty_request_admit(req)) {
+    chatty_request_enqueue(req);
+  } else if (curl_multi_add_handle(client->multi, req->curl) != CURLM_OK) {
+    chatty_request_release(req);
+    return CHATTY_CURL_INIT_ERROR;
+  }
+
+  req->in_flight = true;
+  req->prev = NULL;
+  req->next = client->active;
+  if (client->active != NULL) {
+    client->active->prev = req;
+  }
+  client->active = req;
+  client->active_count++;
+  client->last_activity_ms = chatty_now_ms();
+  return CHATTY_SUCCESS;
+}
+
+/* Put back a request that failed to start, for the next one to reuse */
+static void chatty_request_discard(chatty_Client *client, chatty_Request *req) {
+  chatty_request_unmap_images(req);
+  free(req->chunk.memory);
+  req->chunk.memory = NULL;
+  req->msgv = NULL;
+  req->next = client->idle;
+  client->idle = req;
+}
+
+/* Serialize a request into a recycled request's buffer and hand it to the
+   multi handle. When the caller keeps msgv alive until the request is done
+   (borrowed) and the messages are large, the body is only measured here and
+   written while it is sent. */
+static enum chatty_ERROR
+chatty_client_start(chatty_Client *client, chatty_ClientEndpoint *endpoint,
+                    int msgc, chatty_Message msgv[], bool streaming,
+                    bool borrowed, const chatty_Options *options,
+                    chatty_StreamCallback callback, void *stream_user_data,
+                    chatty_CompletionCallback done, void *user_data,
+                    chatty_Request **request) {
+  if (options->cancel != NULL && chatty_token_cancelled(options->cancel)) {
+    return CHATTY_CANCELLED;
+  }
+
+  chatty_Request *req = client->idle;
+  if (req != NULL) {
+    client->idle = req->next;
+  } else {
+    req = calloc(1, sizeof(chatty_Request));
+    if (req == NULL) {
+      return CHATTY_MEMORY_ERROR;
+    }
+    enum chatty_ERROR error = chatty_setup_curl(&req->curl, client);
+    if (error != CHATTY_SUCCESS) {
+      free(req);
+      return error;
+    }
+  }
+
+  size_t text_len = 0;
+  for (int i = 0; borrowed && i < msgc; i++) {
+    text_len += chatty_message_size(&msgv[i]);
+  }
+  enum chatty_ERROR error;
+  if (text_len >= CHATTY_LAZY_BODY_MIN) {
+    req->payload = NULL;
+    req->msgv = msgv;
+    req->msgc = msgc;
+    req->options = *options;
+    error = chatty_request_map_images(req);
+    if (error == CHATTY_SUCCESS) {
+      error = chatty_measure_payload(&req->body, msgc, msgv, req->maps,
+                                     options, streaming, &req->payload_len);
+    }
+  } else {
+    error = chatty_write_payload(&req->body, msgc, msgv, options, streaming);
+    req->payload = req->body.data;
+    req->payload_len = req->body.len;
+    req->msgv = NULL;
+  }
+  if (error != CHATTY_SUCCESS) {
+    chatty_request_discard(client, req);
+    return error;
+  }
+
+  req->client = client;
+  req->endpoint = endpoint;
+  req->streaming = streaming;
+  req->done = done;
+  req->user_data = user_data;
+  req->chunk.memory = NULL;
+  req->chunk.size = 0;
+  req->attempts = 1;
+  req->backoff_ms = 0;
+  req->body_error = CHATTY_SUCCESS;
+  req->hedge = NULL;
+  req->origin = NULL;
+  req->winner = NULL;
+  req->lost = false;
+  req->deadline_ms =
+      options->timeout_ms > 0 ? chatty_now_ms() + options->timeout_ms : -1;
+  req->connect_timeout_ms =
+      options->connect_timeout_ms > 0 ? options->connect_timeout_ms : 0;
+  req->cancel = options->cancel;
+  req->idle_timeout_ms =
+      streaming && options->stream_idle_timeout_ms > 0
+          ? options->stream_idle_timeout_ms
+          : 0;
+
+  if (streaming) {
+    req->stream_ctx.callback = callback;
+    req->stream_ctx.user_data = stream_user_data;
+    req->stream_ctx.buffer_pos = 0;
+    req->stream_ctx.error_occurred = false;
+    req->stream_ctx.delivered = false;
+    req->stream_ctx.last_event_ms = chatty_now_ms();
+  } else {
+    req->chunk.memory = malloc(1);
+    if (req->chunk.memory == NULL) {
+      chatty_request_discard(client, req);
+      return CHATTY_MEMORY_ERROR;
+    }
+  }
+
+  // Don't hold the caller past its deadline waiting for the provider's window
+  int64_t delay_ms = chatty_governor_acquire(req, 0);
+  if (delay_ms < 0) {
+    chatty_request_discard(client, req);
+    return CHATTY_TIMEOUT;
+  }
+  chatty_request_bind(req);
+  req->hedge_at_ms = -1;
+  // Only requests that could be hedged earn budget, see chatty_hedge_arm()
+  if (client->hedge_delay_ms != 0 && req->msgv == NULL) {
+    chatty_Upstream *upstream = endpoint->upstream;
+    pthread_mutex_lock(&chatty_upstreams_lock);
+    upstream->hedge_budget += CHATTY_HEDGE_BUDGET_REFILL;
+    if (upstream->hedge_budget > CHATTY_HEDGE_BUDGET) {
+      upstream->hedge_budget = CHATTY_HEDGE_BUDGET;
+    }
+    pthread_mutex_unlock(&chatty_upstreams_lock);
+  }
+
+  if (req->cancel != NULL &&
+      !chatty_token_watch(req->cancel, client->multi)) {
+    chatty_request_discard(client, req);
+    return CHATTY_MEMORY_ERROR;
+  }
+
+  error = chatty_client_launch(client, req, delay_ms);
+  if (error != CHATTY_SUCCESS) {
+    if (req->cancel != NULL) {
+      chatty_token_unwatch(req->cancel, client->multi);
+    }
+    chatty_request_discard(client, req);
+    return error;
+  }
+  if (req->cancel != NULL) {
+    client->cancellable++;
+  }
+  if (req->idle_timeout_ms > 0) {
+    client->idle_watched++;
+  }
+  if (!req->parked && !req->queued) {
+    chatty_hedge_arm(req);
+  }
+
+  if (request != NULL) {
+    *request = req;
+  }
+  return CHATTY_SUCCESS;
+}
+
+/* Send a HEAD request to the provider's models endpoint. It only exists to
+   open or refresh a pooled connection, so any HTTP status is a success. */
+static enum chatty_ERROR chatty_client_probe(chatty_Client *client,
+                                             chatty_ClientEndpoint *endpoint,
+                                             chatty_CompletionCallback done,
+                                             void *user_data,
+                                             chatty_Request **request) {
+  if (endpoint->models_url == NULL) {
+    size_t models_url_len =
+        strlen(endpoint->ctx.base_url) + strlen("/models") + 1;
+    endpoint->models_url = malloc(models_url_len);
+    if (endpoint->models_url == NULL) {
+      return CHATTY_MEMORY_ERROR;
+    }
+    snprintf(endpoint->models_url, models_url_len, "%s/models",
+             endpoint->ctx.base_url);
+  }
+
+  chatty_Request *req = calloc(1, sizeof(chatty_Request));
+  if (req == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  enum chatty_ERROR error =
+      chatty_setup_curl(&req->curl, client);
+  if (error != CHATTY_SUCCESS) {
+    free(req);
+    return error;
+  }
+
+  req->client = client;
+  req->endpoint = endpoint;
+  req->key = &endpoint->keys[0];
+  req->probe = true;
+  req->hedge_at_ms = -1;
+  req->deadline_ms = -1;
+  req->idle_timeout_ms = 0;
+  req->done = done;
+  req->user_data = user_data;
+
+  chatty_set_url(req->curl, endpoint->models_url);
+  curl_easy_setopt(req->curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->key->json_headers);
+  curl_easy_setopt(req->curl, CURLOPT_PRIVATE, (void *)req);
+
+  error = chatty_client_launch(client, req, 0);
+  if (error != CHATTY_SUCCESS) {
+    curl_easy_cleanup(req->curl);
+    free(req);
+    return error;
+  }
+
+  if (request != NULL) {
+    *request = req;
+  }
+  return CHATTY_SUCCESS;
+}
+
+/* Race a duplicate of req, sending the same payload on another easy handle.
+   Skipped when the hedge budget is spent. */
+static void chatty_request_hedge(chatty_Request *req) {
+  chatty_Client *client = req->client;
+
+  chatty_Upstream *upstream = req->endpoint->upstream;
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  bool allowed = upstream->hedge_budget >= 1.0;
+  if (allowed) {
+    upstream->hedge_budget -= 1.0;
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  if (!allowed) {
+    return;
+  }
+
+  chatty_Request *dup = client->idle;
+  if (dup != NULL) {
+    client->idle = dup->next;
+  } else {
+    dup = calloc(1, sizeof(chatty_Request));
+    if (dup == NULL) {
+      return;
+    }
+    if (chatty_setup_curl(&dup->curl, client) != CHATTY_SUCCESS) {
+      free(dup);
+      return;
+    }
+  }
+
+  dup->client = client;
+  dup->endpoint = req->endpoint;
+  dup->key = req->key;
+  dup->payload = req->payload; // Borrowed from the origin
+  dup->payload_len = req->payload_len;
+  dup->streaming = req->streaming;
+  dup->done = NULL;
+  dup->hedge_at_ms = -1;
+  dup->hedge = NULL;
+  dup->origin = req;
+  dup->winner = NULL;
+  dup->deadline_ms = req->deadline_ms;
+  dup->connect_timeout_ms = req->connect_timeout_ms;
+  dup->cancel = req->cancel;
+  dup->chunk.size = 0;
+  dup->chunk.memory = req->streaming ? NULL : malloc(1);
+  dup->stream_ctx = req->stream_ctx;
+  dup->stream_ctx.buffer_pos = 0;
+  dup->stream_ctx.error_occurred = false;
+  dup->stream_ctx.delivered = false;
+  dup->stream_ctx.last_event_ms = chatty_now_ms();
+  dup->idle_timeout_ms = 0; // Watched through its origin
+
+  chatty_request_bind(dup);
+  if ((!req->streaming && dup->chunk.memory == NULL) ||
+      curl_multi_add_handle(client->multi, dup->curl) != CURLM_OK) {
+    free(dup->chunk.memory);
+    dup->chunk.memory = NULL;
+    dup->payload = NULL;
+    dup->origin = NULL;
+    dup->next = client->idle;
+    client->idle = dup;
+    return;
+  }
+  req->hedge = dup;
+}
+
+/* End the origin's race by removing its duplicate and recycling it */
+static void chatty_hedge_drop(chatty_Request *origin) {
+  chatty_Client *client = origin->client;
+  chatty_Request *dup = origin->hedge;
+
+  curl_multi_remove_handle(client->multi, dup->curl);
+  free(dup->chunk.memory);
+  dup->chunk.memory = NULL;
+  dup->payload = NULL;
+  dup->origin = NULL;
+  dup->next = client->idle;
+  client->idle = dup;
+  origin->hedge = NULL;
+}
+
+/* The duplicate finished for the origin: take over its transfer and results
+   so the rest of the request's life, retries included, sees one request */
+static void chatty_hedge_adopt(chatty_Request *origin) {
+  chatty_Request *dup = origin->hedge;
+
+  CURL *curl = origin->curl;
+  origin->curl = dup->curl;
+  dup->curl = curl;
+  struct chatty_Memory chunk = origin->chunk;
+  origin->chunk = dup->chunk;
+  dup->chunk = chunk;
+  chatty_StreamContext stream_ctx = origin->stream_ctx;
+  origin->stream_ctx = dup->stream_ctx;
+  dup->stream_ctx = stream_ctx;
+
+  chatty_request_bind(origin);
+  chatty_hedge_drop(origin);
+}
+
+/* Abort whichever attempt lost a race decided during the last transfer
+   step. Their handles can't be removed from inside the write callback. */
+static void chatty_hedge_settle(chatty_Client *client) {
+  client->hedge_settled = false;
+  for (chatty_Request *req = client->active; req != NULL; req = req->next) {
+    if (req->hedge == NULL || req->winner == NULL) {
+      continue;
+    }
+    if (req->winner == req) {
+      chatty_hedge_drop(req);
+    } else if (!req->lost) {
+      curl_multi_remove_handle(client->multi, req->curl);
+      req->lost = true;
+    }
+  }
+}
+
+/* Detach a request from the multi handle, report it and recycle it */
+static void chatty_request_complete(chatty_Request *req,
+                                    enum chatty_ERROR error,
+                                    chatty_Message *response) {
+  chatty_Client *client = req->client;
+
+  if (req->hedge != NULL) {
+    chatty_hedge_drop(req);
+  }
+  req->hedge_at_ms = -1;
+  if (req->parked) {
+    req->parked = false;
+    client->parked--;
+  } else if (req->queued) {
+    chatty_request_dequeue(req);
+  } else {
+    curl_multi_remove_handle(client->multi, req->curl);
+  }
+  chatty_request_release(req);
+  req->in_flight = false;
+  if (req->prev != NULL) {
+    req->prev->next = req->next;
+  } else {
+    client->active = req->next;
+  }
+  if (req->next != NULL) {
+    req->next->prev = req->prev;
+  }
+  client->active_count--;
+  client->last_activity_ms = chatty_now_ms();
+  if (req->cancel != NULL) {
+    chatty_token_unwatch(req->cancel, client->multi);
+    client->cancellable--;
+    req->cancel = NULL;
+  }
+  if (req->idle_timeout_ms > 0) {
+    client->idle_watched--;
+    req->idle_timeout_ms = 0;
+  }
+
+  if (req->done != NULL) {
+    req->done(req, error, response, req->user_data);
+  } else if (response != NULL) {
+    free(response->message);
+  }
+
+  if (req->probe) {
+    curl_easy_cleanup(req->curl);
+    free(req);
+    return;
+  }
+
+  req->payload = NULL;
+  req->msgv = NULL;
+  chatty_request_unmap_images(req);
+  free(req->chunk.memory);
+  req->chunk.memory = NULL;
+  req->next = client->idle;
+  client->idle = req;
+}
+
+/* Failures worth sending the same payload again for: throttling, overload
+   and connections that broke before a reply came back */
+static bool chatty_retryable(CURLcode res, long http_code) {
+  switch (res) {
+  case CURLE_OK:
+    return http_code == 408 || http_code == 429 || http_code == 500 ||
+           http_code == 502 || http_code == 503 || http_code == 504;
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_HTTP2:
+  case CURLE_HTTP2_STREAM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Whether a failed attempt says something about the provider. Transfers
+   stopped on our side, by a callback, a body reader or a failed allocation,
+   must not make the upstream look unhealthy. */
+static bool chatty_upstream_at_fault(CURLcode res) {
+  switch (res) {
+  case CURLE_WRITE_ERROR:
+  case CURLE_READ_ERROR:
+  case CURLE_ABORTED_BY_CALLBACK:
+  case CURLE_OUT_OF_MEMORY:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/* xorshift64*, good enough to spread retries of concurrent clients apart */
+static uint64_t chatty_random(chatty_Client *client) {
+  client->rng ^= client->rng >> 12;
+  client->rng ^= client->rng << 25;
+  client->rng ^= client->rng >> 27;
+  return client->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Pick among the primary or the backup endpoints whose circuit lets a
+   request through, see CHATTY_ROUTE_EXPLORE. Called with the lock held. */
+static chatty_ClientEndpoint *chatty_client_route_among(chatty_Client *client,
+                                                        bool backup,
+                                                        int64_t now) {
+  int allowed = 0;
+  double total = 0;
+  chatty_ClientEndpoint *best = NULL;
+  double best_score = 0;
+  for (int i = 0; i < client->endpoint_count; i++) {
+    chatty_ClientEndpoint *endpoint = &client->endpoints[i];
+    chatty_Upstream *upstream = endpoint->upstream;
+    bool trial;
+    if (endpoint->backup != backup ||
+        !chatty_breaker_allows(client, upstream, now, &trial)) {
+      continue;
+    }
+    if (trial) {
+      // Find out whether an open circuit recovered before anything else
+      upstream->circuit = CHATTY_CIRCUIT_STATE_HALF_OPEN;
+      upstream->circuit_changed_ms = now;
+      return endpoint;
+    }
+    allowed++;
+    total += endpoint->weight;
+
+    double score;
+    if (upstream->ewma_latency_ms < 0) {
+      // Untried goes first, one that only ever failed goes last
+      score = upstream->ewma_error > 0 ? DBL_MAX : -1;
+    } else {
+      score = upstream->ewma_latency_ms *
+              (1 + CHATTY_ROUTE_ERROR_PENALTY * upstream->ewma_error) /
+              endpoint->weight;
+    }
+    if (best == NULL || score < best_score) {
+      best = endpoint;
+      best_score = score;
+    }
+  }
+
+  if (allowed > 1 && chatty_random(client) % CHATTY_ROUTE_EXPLORE == 0) {
+    double pick =
+        (double)(chatty_random(client) >> 11) / (double)(1ULL << 53) * total;
+    for (int i = 0; i < client->endpoint_count; i++) {
+      chatty_ClientEndpoint *endpoint = &client->endpoints[i];
+      bool trial;
+      if (endpoint->backup != backup ||
+          !chatty_breaker_allows(client, endpoint->upstream, now, &trial)) {
+        continue;
+      }
+      pick -= endpoint->weight;
+      if (pick < 0) {
+        return endpoint;
+      }
+    }
+  }
+  return best;
+}
+
+/* Pick the endpoint for a new request, falling over to the backups while
+   every primary circuit is open. NULL when all of them are. */
+static chatty_ClientEndpoint *chatty_client_route(chatty_Client *client) {
+  if (client->endpoint_count == 1 && !client->circuit_breaker) {
+    return &client->endpoints[0];
+  }
+
+  int64_t now = chatty_now_ms();
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  chatty_ClientEndpoint *endpoint =
+      chatty_client_route_among(client, false, now);
+  if (endpoint == NULL) {
+    endpoint = chatty_client_route_among(client, true, now);
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  return endpoint;
+}
+
+/* Milliseconds to wait before sending a failed request again, or -1 to give
+   up. Backoff grows exponentially with decorrelated jitter, between the base
+   and three times the previous wait, and never undercuts Retry-After. A
+   stream is only retried while its callback has not seen any of the reply. */
+static int64_t chatty_retry_delay(chatty_Request *req, CURLcode res,
+                                  long http_code) {
+  chatty_Client *client = req->client;
+  if (req->attempts > client->max_retries || !chatty_retryable(res, http_code) ||
+      (req->streaming && req->stream_ctx.delivered)) {
+    return -1;
+  }
+  if (client->circuit_breaker) {
+    pthread_mutex_lock(&chatty_upstreams_lock);
+    bool open = req->endpoint->upstream->circuit != CHATTY_CIRCUIT_STATE_CLOSED;
+    pthread_mutex_unlock(&chatty_upstreams_lock);
+    if (open) {
+      return -1;
+    }
+  }
+
+  int64_t base = client->retry_base_ms;
+  int64_t upper = req->backoff_ms > 0 ? req->backoff_ms * 3 : base;
+  int64_t delay = base + (int64_t)(chatty_random(client) %
+                                   (uint64_t)(upper - base + 1));
+  if (delay > client->retry_max_ms) {
+    delay = client->retry_max_ms;
+  }
+
+  // The provider knows best when it can take us back. Past our cap, fail now
+  // rather than hold the caller hostage. A 429 only speaks for the key, and
+  // the governor moves the retry to another one of the pool.
+  curl_off_t retry_after = 0;
+  if ((http_code != 429 || req->endpoint->key_count == 1) &&
+      curl_easy_getinfo(req->curl, CURLINFO_RETRY_AFTER, &retry_after) ==
+          CURLE_OK &&
+      retry_after > 0) {
+    if ((int64_t)retry_after * 1000 > client->retry_max_ms) {
+      return -1;
+    }
+    if ((int64_t)retry_after * 1000 > delay) {
+      delay = (int64_t)retry_after * 1000;
+    }
+  }
+
+  // Don't start an attempt the deadline would cut short anyway
+  if (chatty_request_out_of_time(req, delay)) {
+    return -1;
+  }
+
+  chatty_Upstream *upstream = req->endpoint->upstream;
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  bool allowed = upstream->retry_budget >= 1.0;
+  if (allowed) {
+    upstream->retry_budget -= 1.0;
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  if (!allowed) {
+    return -1;
+  }
+
+  req->backoff_ms = delay;
+  return delay;
+}
+
+/* Take a failed attempt off the multi handle and park it until delay_ms
+   from now, or later if the rate governor says so. The easy handle keeps
+   its serialized payload, so chatty_client_service() only has to rebind it
+   to the key the governor picked and add it back. */
+static void chatty_request_retry(chatty_Request *req, int64_t delay_ms) {
+  chatty_Client *client = req->client;
+
+  curl_multi_remove_handle(client->multi, req->curl);
+  chatty_request_release(req);
+  req->attempts++;
+  req->chunk.size = 0;
+  if (req->chunk.memory != NULL) {
+    req->chunk.memory[0] = '\0';
+  }
+  req->stream_ctx.buffer_pos = 0;
+  req->winner = NULL;
+  req->lost = false;
+  req->hedge_at_ms = -1;
+  int64_t governor_ms = chatty_governor_acquire(req, delay_ms);
+  if (governor_ms < 0) {
+    chatty_request_complete(req, CHATTY_TIMEOUT, NULL);
+    return;
+  }
+  if (governor_ms > delay_ms) {
+    delay_ms = governor_ms;
+  }
+  req->parked = true;
+  req->wake_at_ms = chatty_now_ms() + delay_ms;
+  client->parked++;
+}
+
+/* When the stream last showed signs of life, on either attempt of a race */
+static int64_t chatty_request_last_event(chatty_Request *req) {
+  int64_t last_event_ms = req->stream_ctx.last_event_ms;
+  if (req->hedge != NULL &&
+      req->hedge->stream_ctx.last_event_ms > last_event_ms) {
+    last_event_ms = req->hedge->stream_ctx.last_event_ms;
+  }
+  return last_event_ms;
+}
+
+/* The provider went quiet mid-stream. Start over if the callback hasn't
+   seen anything yet and the retry policy allows, otherwise report it. */
+static void chatty_request_stall(chatty_Request *req) {
+  if (req->hedge != NULL) {
+    chatty_hedge_drop(req);
+  }
+
+  chatty_upstream_record_outcome(req->endpoint->upstream, -1);
+  chatty_breaker_record(req->client, req->endpoint->upstream, true);
+  int64_t delay_ms = chatty_retry_delay(req, CURLE_OPERATION_TIMEDOUT, 0);
+  if (delay_ms >= 0) {
+    chatty_request_retry(req, delay_ms);
+  } else {
+    chatty_request_complete(req, CHATTY_STREAM_STALLED, NULL);
+  }
+}
+
+/* Turn a finished transfer into a chatty result */
+static void chatty_request_finish(chatty_Request *req, CURLcode res) {
+  if (req->probe) {
+    chatty_request_complete(
+        req, res == CURLE_OK ? CHATTY_SUCCESS : CHATTY_CURL_NETWORK_ERROR,
+        NULL);
+    return;
+  }
+
+  long http_code = 0;
+  curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+  // While a race is on, only its winner or the last attempt standing decides
+  // the outcome. An attempt that fails early leaves the other to carry on.
+  chatty_Request *origin = req->origin != NULL ? req->origin : req;
+  if (origin->hedge != NULL) {
+    bool other_running = req == origin || !origin->lost;
+    bool won = origin->winner == req ||
+               (origin->winner == NULL && res == CURLE_OK && http_code == 200);
+    if (other_running && !won) {
+      if (req == origin) {
+        curl_multi_remove_handle(origin->client->multi, origin->curl);
+        origin->lost = true;
+      } else {
+        chatty_hedge_drop(origin);
+      }
+      return;
+    }
+    if (req == origin) {
+      chatty_hedge_drop(origin);
+    } else {
+      chatty_hedge_adopt(origin);
+    }
+    req = origin;
+    req->winner = NULL;
+    req->lost = false;
+  }
+
+  chatty_Client *client = req->client;
+  chatty_Upstream *upstream = req->endpoint->upstream;
+  if (res != CURLE_OK || http_code != 200) {
+    if (res == CURLE_ABORTED_BY_CALLBACK && req->cancel != NULL &&
+        chatty_token_cancelled(req->cancel)) {
+      chatty_request_complete(req, CHATTY_CANCELLED, NULL);
+      return;
+    }
+    if (res == CURLE_ABORTED_BY_CALLBACK &&
+        req->body_error != CHATTY_SUCCESS) {
+      chatty_request_complete(req, req->body_error, NULL);
+      return;
+    }
+    // The stream callback asked to stop, or a write callback ran out of
+    // memory. Neither is the provider's doing, nor worth another attempt.
+    if (res == CURLE_WRITE_ERROR) {
+      chatty_request_complete(req,
+                              req->streaming ? CHATTY_STREAM_CALLBACK_ERROR
+                                             : CHATTY_MEMORY_ERROR,
+                              NULL);
+      return;
+    }
+    if (chatty_upstream_at_fault(res)) {
+      chatty_upstream_record_outcome(upstream, -1);
+    }
+    // A cached address that no longer answers must not outlive this
+    // failure: drop it from the DNS cache and from the file
+    if (res == CURLE_COULDNT_CONNECT && client->resolve != NULL &&
+        !client->unpinned && req->endpoint == &client->endpoints[0]) {
+      client->unpinned = true;
+      if (client->unpin != NULL) {
+        curl_easy_setopt(req->curl, CURLOPT_RESOLVE, client->unpin);
+      }
+      client->cache_addr[0] = '\0';
+      client->cache_dirty = true;
+    }
+    if (http_code == 429) {
+      chatty_quota_exhaust(req->key->quota, req->curl);
+    }
+    if (res != CURLE_OK || http_code == 408 || http_code == 429 ||
+        http_code >= 500) {
+      chatty_breaker_record(client, upstream, true);
+    }
+    if (client->adaptive_concurrency &&
+        (http_code == 429 || http_code == 503 || http_code == 504 ||
+         res == CURLE_OPERATION_TIMEDOUT || res == CURLE_COULDNT_CONNECT)) {
+      chatty_limiter_feedback(upstream, true);
+    }
+    int64_t delay_ms = chatty_retry_delay(req, res, http_code);
+    if (delay_ms >= 0) {
+      chatty_request_retry(req, delay_ms);
+    } else {
+      chatty_request_complete(req,
+                              res == CURLE_OPERATION_TIMEDOUT
+                                  ? CHATTY_TIMEOUT
+                                  : CHATTY_CURL_NETWORK_ERROR,
+                              NULL);
+    }
+    return;
+  }
+
+  curl_off_t ttfb_us = 0;
+  if (curl_easy_getinfo(req->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us) ==
+          CURLE_OK &&
+      ttfb_us > 0) {
+    chatty_upstream_record_ttfb(upstream, (int64_t)ttfb_us);
+    chatty_upstream_record_outcome(upstream, (double)ttfb_us / 1000.0);
+    chatty_breaker_record(client, upstream,
+                          client->breaker_slow_ms > 0 &&
+                              (int64_t)ttfb_us / 1000 > client->breaker_slow_ms);
+    if (client->adaptive_concurrency) {
+      pthread_mutex_lock(&chatty_upstreams_lock);
+      int64_t baseline_ms = upstream->ttfb_p10_ms;
+      pthread_mutex_unlock(&chatty_upstreams_lock);
+      chatty_limiter_feedback(upstream,
+                              baseline_ms >= 0 &&
+                                  (int64_t)ttfb_us / 1000 > 2 * baseline_ms &&
+                                  (int64_t)ttfb_us / 1000 > 10);
+    }
+  }
+
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  upstream->retry_budget += CHATTY_RETRY_BUDGET_REFILL;
+  if (upstream->retry_budget > CHATTY_RETRY_BUDGET) {
+    upstream->retry_budget = CHATTY_RETRY_BUDGET;
+  }
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+
+  // Remember where the provider lives for the next process. A pinned
+  // address keeps the time it was looked up, so it still expires.
+  char *primary_ip = NULL;
+  if (client->cache_path != NULL && req->endpoint == &client->endpoints[0] &&
+      curl_easy_getinfo(req->curl, CURLINFO_PRIMARY_IP, &primary_ip) ==
+          CURLE_OK &&
+      primary_ip != NULL && strlen(primary_ip) < sizeof(client->cache_addr)) {
+    if (client->resolve == NULL || client->unpinned ||
+        client->cache_resolved_at == 0) {
+      client->cache_resolved_at = time(NULL);
+    }
+    strcpy(client->cache_addr, primary_ip);
+    curl_easy_getinfo(req->curl, CURLINFO_PRIMARY_PORT, &client->cache_port);
+    client->cache_dirty = true;
+  }
+
+  if (req->streaming) {
+    chatty_request_complete(req,
+                            req->stream_ctx.error_occurred
+                                ? CHATTY_STREAM_CALLBACK_ERROR
+                                : CHATTY_SUCCESS,
+                            NULL);
+    return;
+  }
+
+  chatty_Message response;
+  enum chatty_ERROR error = chatty_parse_response(req->chunk.memory, &response);
+  chatty_request_complete(req, error,
+                          error == CHATTY_SUCCESS ? &response : NULL);
+}
+
+static void chatty_sync_done(chatty_Request *request, enum chatty_ERROR error,
+                             chatty_Message *response, void *user_data) {
+  (void)request;
+  chatty_SyncResult *result = (chatty_SyncResult *)user_data;
+
+  result->finished = true;
+  result->error = error;
+  if (response != NULL && result->response != NULL) {
+    *result->response = *response;
+  }
+}
+
+/* When the client next needs to run its own housekeeping, or -1 */
+static int64_t chatty_client_next_wakeup(chatty_Client *client) {
+  if (client->keep_warm_ms > 0 && client->active == NULL) {
+    return client->last_activity_ms + client->keep_warm_ms;
+  }
+
+  int64_t wakeup = -1;
+  if (client->queued > 0) {
+    wakeup = chatty_now_ms() + CHATTY_QUEUE_POLL_MS;
+  }
+  if (client->parked > 0 || client->queued > 0 || client->hedge_delay_ms != 0 ||
+      client->idle_watched > 0) {
+    for (chatty_Request *req = client->active; req != NULL; req = req->next) {
+      if (req->parked && (wakeup < 0 || req->wake_at_ms < wakeup)) {
+        wakeup = req->wake_at_ms;
+      }
+      // Requests on the multi handle are timed out by curl
+      if ((req->parked || req->queued) && req->deadline_ms >= 0 &&
+          (wakeup < 0 || req->deadline_ms < wakeup)) {
+        wakeup = req->deadline_ms;
+      }
+      // Only a stream that has been sent can go quiet
+      if (req->idle_timeout_ms > 0 && !req->parked && !req->queued) {
+        int64_t stall_at = chatty_request_last_event(req) + req->idle_timeout_ms;
+        if (wakeup < 0 || stall_at < wakeup) {
+          wakeup = stall_at;
+        }
+      }
+      if (req->hedge_at_ms >= 0 && (wakeup < 0 || req->hedge_at_ms < wakeup)) {
+        wakeup = req->hedge_at_ms;
+      }
+    }
+  }
+  return wakeup;
+}
+
+/* Send a request that was held back, refreshing what depends on when it
+   actually goes out */
+static void chatty_request_resume(chatty_Request *req) {
+  req->stream_ctx.last_event_ms = chatty_now_ms();
+  chatty_request_bind(req);
+  if (curl_multi_add_handle(req->client->multi, req->curl) != CURLM_OK) {
+    chatty_request_complete(req, CHATTY_CURL_INIT_ERROR, NULL);
+    return;
+  }
+  chatty_hedge_arm(req);
+}
+
+/* Run housekeeping that has come due */
+static void chatty_client_service(chatty_Client *client) {
+  int64_t now = chatty_now_ms();
+  if (client->parked > 0 || client->queued > 0 || client->hedge_delay_ms != 0 ||
+      client->cancellable > 0 || client->idle_watched > 0) {
+    chatty_Request *req = client->active;
+    while (req != NULL) {
+      chatty_Request *next = req->next;
+      if (req->cancel != NULL && chatty_token_cancelled(req->cancel)) {
+        chatty_request_complete(req, CHATTY_CANCELLED, NULL);
+      } else if ((req->parked || req->queued) && req->deadline_ms >= 0 &&
+                 now >= req->deadline_ms) {
+        // Held back until too late to send
+        chatty_request_complete(req, CHATTY_TIMEOUT, NULL);
+      } else if (req->idle_timeout_ms > 0 && !req->parked && !req->queued &&
+                 now - chatty_request_last_event(req) >= req->idle_timeout_ms) {
+        chatty_request_stall(req);
+      } else if (req->parked && req->wake_at_ms <= now) {
+        req->parked = false;
+        client->parked--;
+        if (chatty_request_admit(req)) {
+          chatty_request_resume(req);
+        } else {
+          chatty_request_enqueue(req);
+        }
+      } else if (req->hedge_at_ms >= 0 && req->hedge_at_ms <= now) {
+        // Only hedge a request that is still waiting for its first byte
+        curl_off_t ttfb_us = 0;
+        req->hedge_at_ms = -1;
+        curl_easy_getinfo(req->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+        if (ttfb_us == 0) {
+          chatty_request_hedge(req);
+        }
+      }
+      req = next;
+    }
+  }
+
+  // Hand freed concurrency slots to queued requests, oldest first
+  for (int i = 0; i < client->endpoint_count && client->queued > 0; i++) {
+    chatty_ClientEndpoint *endpoint = &client->endpoints[i];
+    while (endpoint->queue_head != NULL &&
+           chatty_limiter_acquire(endpoint->upstream)) {
+      chatty_Request *req = endpoint->queue_head;
+      chatty_request_dequeue(req);
+      req->has_slot = true;
+      chatty_request_resume(req);
+    }
+  }
+
+  int64_t wakeup = chatty_client_next_wakeup(client);
+  if (wakeup >= 0 && wakeup <= now && client->active == NULL) {
+    // An idle pool goes cold. Failing that, try again one interval later.
+    for (int i = 0; i < client->endpoint_count; i++) {
+      if (chatty_client_probe(client, &client->endpoints[i], NULL, NULL,
+                              NULL) != CHATTY_SUCCESS) {
+        client->last_activity_ms = chatty_now_ms();
+      }
+    }
+  }
+}
+
+/* Drive the client until one request has completed */
+static enum chatty_ERROR chatty_client_wait(chatty_Client *client,
+                                            chatty_Request *request,
+                                            chatty_SyncResult *result) {
+  while (!result->finished) {
+    enum chatty_ERROR error = chatty_client_perform(client, 1000, NULL);
+    if (error != CHATTY_SUCCESS) {
+      if (!result->finished) {
+        chatty_client_cancel(client, request);
+      }
+      return error;
+    }
+  }
+  return result->error;
+}
+
+/* Build a key's headers once and find the quota it shares with the other
+   clients of the upstream */
+static enum chatty_ERROR chatty_key_init(chatty_ClientKey *key,
+                                         chatty_Upstream *upstream,
+                                         const char *api_key) {
+  size_t header_len = strlen("Authorization: Bearer ") + strlen(api_key) + 1;
+  char *bearer_header = malloc(header_len);
+  if (bearer_header == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  snprintf(bearer_header, header_len, "Authorization: Bearer %s", api_key);
+  key->json_headers = chatty_create_headers(bearer_header, false);
+  key->stream_headers = chatty_create_headers(bearer_header, true);
+  free(bearer_header);
+
+  key->quota = chatty_get_quota(upstream, api_key);
+  if (key->json_headers == NULL || key->stream_headers == NULL ||
+      key->quota == NULL) {
+    curl_slist_free_all(key->json_headers);
+    curl_slist_free_all(key->stream_headers);
+    return CHATTY_MEMORY_ERROR;
+  }
+  return CHATTY_SUCCESS;
+}
+
+static void chatty_endpoint_cleanup(chatty_ClientEndpoint *endpoint) {
+  for (int i = 0; i < endpoint->key_count && !endpoint->shared; i++) {
+    curl_slist_free_all(endpoint->keys[i].json_headers);
+    curl_slist_free_all(endpoint->keys[i].stream_headers);
+  }
+  free(endpoint->keys);
+  free(endpoint->models_url);
+  if (!endpoint->shared) {
+    chatty_cleanup_request_context(&endpoint->ctx);
+  }
+  free(endpoint->base_url);
+  free(endpoint->api_key);
+  free(endpoint->model);
+}
+
+/* The provider the environment points at, resolved on first use and never
+   changed or freed after, so clients created without a base URL or key
+   share its context and headers instead of repeating the lookups. A failed
+   resolution isn't kept, the next client tries again. */
+typedef struct chatty_DefaultProvider {
+  chatty_RequestContext ctx;
+  chatty_Upstream *upstream;
+  chatty_ClientKey key;
+} chatty_DefaultProvider;
+
+static chatty_DefaultProvider *chatty_default_provider;
+static pthread_mutex_t chatty_default_provider_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static enum chatty_ERROR
+chatty_get_default_provider(chatty_DefaultProvider **provider) {
+  enum chatty_ERROR error = CHATTY_SUCCESS;
+  pthread_mutex_lock(&chatty_default_provider_lock);
+  if (chatty_default_provider == NULL) {
+    chatty_DefaultProvider *resolved = calloc(1, sizeof(chatty_DefaultProvider));
+    if (resolved == NULL) {
+      error = CHATTY_MEMORY_ERROR;
+    } else {
+      error = chatty_init_request_context(&resolved->ctx, NULL, NULL);
+      if (error == CHATTY_SUCCESS) {
+        resolved->upstream = chatty_get_upstream(resolved->ctx.base_url);
+        error = resolved->upstream == NULL
+                    ? CHATTY_MEMORY_ERROR
+                    : chatty_key_init(&resolved->key, resolved->upstream,
+                                      resolved->ctx.api_key);
+        if (error != CHATTY_SUCCESS) {
+          chatty_cleanup_request_context(&resolved->ctx);
+        }
+      }
+      if (error == CHATTY_SUCCESS) {
+        chatty_default_provider = resolved;
+      } else {
+        free(resolved);
+      }
+    }
+  }
+  *provider = chatty_default_provider;
+  pthread_mutex_unlock(&chatty_default_provider_lock);
+  return error;
+}
+
+/* Client defaults set by the environment, read once per process like the
+   default provider so that chatty_chat() doesn't look them up on each call.
+   Never freed. */
+static struct {
+  long hedge_delay_ms; /* 0 when CHATTY_HEDGE_DELAY_MS is unset */
+  char *cache_path;    /* CHATTY_CACHE_FILE, or NULL */
+} chatty_env_defaults;
+static pthread_once_t chatty_env_defaults_once = PTHREAD_ONCE_INIT;
+
+static void chatty_env_defaults_init(void) {
+  char *hedge_env = curl_getenv("CHATTY_HEDGE_DELAY_MS");
+  if (hedge_env != NULL) {
+    long hedge_delay_ms = strtol(hedge_env, NULL, 10);
+    chatty_env_defaults.hedge_delay_ms =
+        hedge_delay_ms < 0 ? -1 : hedge_delay_ms;
+    curl_free(hedge_env);
+  }
+  char *cache_env = curl_getenv("CHATTY_CACHE_FILE");
+  if (cache_env != NULL) {
+    chatty_env_defaults.cache_path = strdup(cache_env);
+    curl_free(cache_env);
+  }
+}
+
+/* Copy an endpoint's options and resolve its provider. On failure the
+   endpoint holds nothing that needs freeing. */
+static enum chatty_ERROR chatty_endpoint_init(chatty_ClientEndpoint *endpoint,
+                                              const chatty_Endpoint *options) {
+  // The first key of a pool stands in for api_key
+  const char *api_key =
+      options->api_key_count > 0 ? options->api_keys[0] : options->api_key;
+  int key_count = options->api_key_count > 0 ? options->api_key_count : 1;
+
+  endpoint->weight = options->weight > 0 ? options->weight : 1.0;
+  endpoint->backup = options->backup;
+  endpoint->keys = calloc(key_count, sizeof(chatty_ClientKey));
+  if (endpoint->keys == NULL ||
+      (options->base_url != NULL &&
+       (endpoint->base_url = strdup(options->base_url)) == NULL) ||
+      (api_key != NULL && (endpoint->api_key = strdup(api_key)) == NULL) ||
+      (options->model != NULL &&
+       (endpoint->model = strdup(options->model)) == NULL)) {
+    free(endpoint->keys);
+    free(endpoint->base_url);
+    free(endpoint->api_key);
+    return CHATTY_MEMORY_ERROR;
+  }
+
+  // Nothing configured, the environment decides
+  if (endpoint->base_url == NULL && endpoint->api_key == NULL) {
+    chatty_DefaultProvider *provider;
+    enum chatty_ERROR error = chatty_get_default_provider(&provider);
+    if (error != CHATTY_SUCCESS) {
+      free(endpoint->keys);
+      free(endpoint->model);
+      return error;
+    }
+    endpoint->shared = true;
+    endpoint->ctx = provider->ctx;
+    endpoint->upstream = provider->upstream;
+    endpoint->keys[0] = provider->key;
+    endpoint->key_count = 1;
+    return CHATTY_SUCCESS;
+  }
+
+  enum chatty_ERROR error = chatty_init_request_context(
+      &endpoint->ctx, endpoint->base_url, endpoint->api_key);
+  if (error != CHATTY_SUCCESS) {
+    free(endpoint->keys);
+    free(endpoint->base_url);
+    free(endpoint->api_key);
+    free(endpoint->model);
+    return error;
+  }
+
+  endpoint->upstream = chatty_get_upstream(endpoint->ctx.base_url);
+  if (endpoint->upstream == NULL) {
+    error = CHATTY_MEMORY_ERROR;
+  }
+  for (int i = 0; i < key_count && error == CHATTY_SUCCESS; i++) {
+    error = chatty_key_init(&endpoint->keys[i], endpoint->upstream,
+                            i == 0 ? endpoint->ctx.api_key
+                                   : options->api_keys[i]);
+    if (error == CHATTY_SUCCESS) {
+      endpoint->key_count++;
+    }
+  }
+  if (error != CHATTY_SUCCESS) {
+    chatty_endpoint_cleanup(endpoint);
+  }
+  return error;
+}
+
+enum chatty_ERROR chatty_client_new(const chatty_ClientOptions *options,
+                                    chatty_Client **client) {
+  if (client == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+  *client = NULL;
+
+  chatty_Client *c = calloc(1, sizeof(chatty_Client));
+  if (c == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+
+  // A single base URL is a client with one endpoint
+  chatty_Endpoint single = {0};
+  const chatty_Endpoint *endpoints = &single;
+  int endpoint_count = 1;
+  if (options != NULL && options->endpoint_count > 0) {
+    if (options->endpoints == NULL) {
+      free(c);
+      return CHATTY_INVALID_OPTIONS;
+    }
+    endpoints = options->endpoints;
+    endpoint_count = options->endpoint_count;
+  } else if (options != NULL) {
+    single.base_url = options->base_url;
+    single.api_key = options->api_key;
+    single.api_keys = options->api_keys;
+    single.api_key_count = options->api_key_count;
+  }
+  for (int i = 0; i < endpoint_count; i++) {
+    bool valid = (endpoint_count == 1 || endpoints[i].base_url != NULL) &&
+                 endpoints[i].weight >= 0 && endpoints[i].api_key_count >= 0 &&
+                 (endpoints[i].api_key_count == 0 ||
+                  endpoints[i].api_keys != NULL);
+    for (int k = 0; valid && k < endpoints[i].api_key_count; k++) {
+      valid = endpoints[i].api_keys[k] != NULL;
+    }
+    if (!valid) {
+      free(c);
+      return CHATTY_INVALID_OPTIONS;
+    }
+  }
+
+  c->endpoints = calloc(endpoint_count, sizeof(chatty_ClientEndpoint));
+  if (c->endpoints == NULL) {
+    free(c);
+    return CHATTY_MEMORY_ERROR;
+  }
+
+  // From here on chatty_client_free() knows how to undo everything
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  // Resolve each provider once for the lifetime of the client
+  enum chatty_ERROR error = CHATTY_SUCCESS;
+  for (int i = 0; i < endpoint_count && error == CHATTY_SUCCESS; i++) {
+    error = chatty_endpoint_init(&c->endpoints[i], &endpoints[i]);
+    if (error == CHATTY_SUCCESS) {
+      c->endpoint_count++;
+    }
+  }
+  if (error != CHATTY_SUCCESS) {
+    chatty_client_free(c);
+    return error;
+  }
+
+  if (options == NULL || !options->isolated_cache) {
+    c->share = chatty_get_share();
+  }
+  if (options != NULL && options->keep_warm_ms > 0) {
+    c->keep_warm_ms = options->keep_warm_ms;
+  }
+  c->last_activity_ms = chatty_now_ms();
+
+  c->max_retries = CHATTY_RETRY_MAX;
+  c->retry_base_ms = CHATTY_RETRY_BASE_MS;
+  c->retry_max_ms = CHATTY_RETRY_CAP_MS;
+  if (options != NULL && options->max_retries != 0) {
+    c->max_retries = options->max_retries > 0 ? options->max_retries : 0;
+  }
+  if (options != NULL && options->retry_base_ms > 0) {
+    c->retry_base_ms = options->retry_base_ms;
+  }
+  if (options != NULL && options->retry_max_ms > 0) {
+    c->retry_max_ms = options->retry_max_ms;
+  }
+  if (c->retry_max_ms < c->retry_base_ms) {
+    c->retry_max_ms = c->retry_base_ms;
+  }
+
+  // Hedging is opt-in, through the options or the environment
+  pthread_once(&chatty_env_defaults_once, chatty_env_defaults_init);
+  if (options != NULL && options->hedge_delay_ms != 0) {
+    c->hedge_delay_ms = options->hedge_delay_ms < 0 ? -1 : options->hedge_delay_ms;
+  } else {
+    c->hedge_delay_ms = chatty_env_defaults.hedge_delay_ms;
+  }
+  c->rate_governor = options == NULL || !options->ignore_rate_limits;
+  c->adaptive_concurrency = options != NULL && options->adaptive_concurrency;
+  c->circuit_breaker = options != NULL && options->circuit_breaker;
+  c->breaker_error_rate = CHATTY_BREAKER_ERROR_RATE;
+  c->breaker_open_ms = CHATTY_BREAKER_OPEN_MS;
+  if (c->circuit_breaker && options->breaker_error_rate > 0) {
+    c->breaker_error_rate = options->breaker_error_rate;
+  }
+  if (c->circuit_breaker && options->breaker_slow_ms > 0) {
+    c->breaker_slow_ms = options->breaker_slow_ms;
+  }
+  if (c->circuit_breaker && options->breaker_open_ms > 0) {
+    c->breaker_open_ms = options->breaker_open_ms;
+  }
+  c->rng = ((uint64_t)c->last_activity_ms << 20) ^ (uint64_t)(uintptr_t)c ^
+           (uint64_t)getpid();
+  if (c->rng == 0) {
+    c->rng = 0x9E3779B97F4A7C15ULL;
+  }
+
+  // The cache is opt-in, through the options or the environment
+  if (options != NULL && options->cache_path != NULL) {
+    c->cache_path = strdup(options->cache_path);
+  } else if (chatty_env_defaults.cache_path != NULL) {
+    c->cache_path = strdup(chatty_env_defaults.cache_path);
+  }
+  if (c->cache_path != NULL) {
+    chatty_cache_load(c);
+  }
+
+  c->multi = curl_multi_init();
+  if (c->multi == NULL) {
+    error = CHATTY_CURL_INIT_ERROR;
+  } else {
+    curl_multi_setopt(c->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    if (options != NULL && options->max_host_connections > 0) {
+      curl_multi_setopt(c->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                        options->max_host_connections);
+    }
+    if (options != NULL && options->max_concurrent_streams > 0) {
+      curl_multi_setopt(c->multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                        options->max_concurrent_streams);
+    }
+  }
+  if (error != CHATTY_SUCCESS) {
+    chatty_client_free(c);
+    return error;
+  }
+
+  *client = c;
+  return CHATTY_SUCCESS;
+}
+
+void chatty_client_free(chatty_Client *client) {
+  if (client == NULL) {
+    return;
+  }
+
+  while (client->active != NULL) {
+    chatty_client_cancel(client, client->active);
+  }
+  if (client->cache_path != NULL && client->cache_dirty) {
+    chatty_cache_save(client);
+  }
+  while (client->idle != NULL) {
+    chatty_Request *req = client->idle;
+    client->idle = req->next;
+    curl_easy_cleanup(req->curl);
+    free(req->body.data);
+    free(req);
+  }
+  if (client->multi) {
+    curl_multi_cleanup(client->multi);
+  }
+
+  for (int i = 0; i < client->endpoint_count; i++) {
+    chatty_endpoint_cleanup(&client->endpoints[i]);
+  }
+  free(client->endpoints);
+  free(client->cache_path);
+  curl_slist_free_all(client->resolve);
+  curl_slist_free_all(client->unpin);
+  curl_global_cleanup();
+  free(client);
+}
+
+/* Validate a request and route it, switching options to the chosen
+   endpoint's name for the model */
+static enum chatty_ERROR
+chatty_client_prepare(chatty_Client *client, int msgc, chatty_Message msgv[],
+                      chatty_Options *options,
+                      chatty_ClientEndpoint **endpoint) {
+  enum chatty_ERROR error = chatty_validate_input(msgc, msgv, *options);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  *endpoint = chatty_client_route(client);
+  if (*endpoint == NULL) {
+    return CHATTY_CIRCUIT_OPEN;
+  }
+  if ((*endpoint)->model != NULL) {
+    options->model = (*endpoint)->model;
+  }
+  return CHATTY_SUCCESS;
+}
+
+enum chatty_ERROR chatty_client_submit(chatty_Client *client, int msgc,
+                                       chatty_Message msgv[],
+                                       chatty_Options options,
+                                       chatty_CompletionCallback done,
+                                       void *user_data,
+                                       chatty_Request **request) {
+  // Input validation
+  if (client == NULL || done == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  chatty_ClientEndpoint *endpoint;
+  enum chatty_ERROR error =
+      chatty_client_prepare(client, msgc, msgv, &options, &endpoint);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  return chatty_client_start(client, endpoint, msgc, msgv, false, false,
+                             &options, NULL, NULL, done, user_data, request);
+}
 
-  // Cleanup request resources
-  free(payload);
-  curl_slist_free_all(headers);
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
-  chatty_cleanup_request_context(&ctx);
+enum chatty_ERROR chatty_client_submit_stream(
+    chatty_Client *client, int msgc, chatty_Message msgv[],
+    chatty_Options options, chatty_StreamCallback callback,
+    chatty_CompletionCallback done, void *user_data,
+    chatty_Request **request) {
+  // Input validation
+  if (client == NULL || callback == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
 
-  if (res != CURLE_OK || http_code != 200) {
-    return CHATTY_CURL_NETWORK_ERROR;
+  chatty_ClientEndpoint *endpoint;
+  enum chatty_ERROR error =
+      chatty_client_prepare(client, msgc, msgv, &options, &endpoint);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  return chatty_client_start(client, endpoint, msgc, msgv, true, false,
+                             &options, callback, user_data, done, user_data,
+                             request);
+}
+
+/* Report finished transfers. Completion callbacks may submit new requests. */
+static void chatty_client_reap(chatty_Client *client) {
+  CURLMsg *msg;
+  int msgs_left;
+  while ((msg = curl_multi_info_read(client->multi, &msgs_left)) != NULL) {
+    if (msg->msg == CURLMSG_DONE) {
+      chatty_Request *req;
+      CURLcode res = msg->data.result;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+      chatty_request_finish(req, res);
+    }
+  }
+  if (client->hedge_settled) {
+    chatty_hedge_settle(client);
+  }
+}
+
+enum chatty_ERROR chatty_client_perform(chatty_Client *client, int timeout_ms,
+                                        int *running) {
+  // An attached event loop owns the sockets, see chatty_loop_attach()
+  if (client == NULL || client->loop_socket != NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  // Don't sleep past the client's own housekeeping
+  int64_t wakeup = chatty_client_next_wakeup(client);
+  if (wakeup >= 0) {
+    int64_t until = wakeup - chatty_now_ms();
+    if (until < timeout_ms) {
+      timeout_ms = until > 0 ? (int)until : 0;
+    }
+  }
+
+  CURLMcode mc = CURLM_OK;
+  if (client->active != NULL || wakeup >= 0) {
+    int still_running;
+    mc = curl_multi_poll(client->multi, NULL, 0, timeout_ms, NULL);
+    if (mc == CURLM_OK) {
+      mc = curl_multi_perform(client->multi, &still_running);
+    }
+  }
+
+  chatty_client_reap(client);
+  chatty_client_service(client);
+
+  if (running != NULL) {
+    *running = client->active_count;
+  }
+  return mc == CURLM_OK ? CHATTY_SUCCESS : CHATTY_CURL_NETWORK_ERROR;
+}
+
+enum chatty_ERROR chatty_client_cancel(chatty_Client *client,
+                                       chatty_Request *request) {
+  if (client == NULL || request == NULL || request->client != client ||
+      !request->in_flight) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  chatty_request_complete(request, CHATTY_CANCELLED, NULL);
+  return CHATTY_SUCCESS;
+}
+
+static int chatty_loop_socket_cb(CURL *easy, curl_socket_t fd, int what,
+                                 void *userp, void *socketp) {
+  (void)easy;
+  (void)socketp;
+  chatty_Client *client = (chatty_Client *)userp;
+
+  int events = CHATTY_LOOP_NONE;
+  if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) {
+    events |= CHATTY_LOOP_READ;
+  }
+  if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) {
+    events |= CHATTY_LOOP_WRITE;
+  }
+
+  return client->loop_socket((int)fd, events, client->loop_data) == 0 ? 0 : -1;
+}
+
+/* Point the host timer at whichever comes first, curl's timeout or the
+   client's housekeeping. Left alone when unchanged, saving the host a
+   syscall. */
+static int chatty_loop_arm(chatty_Client *client) {
+  int64_t deadline = client->curl_deadline_ms;
+  int64_t wakeup = chatty_client_next_wakeup(client);
+  if (wakeup >= 0 && (deadline < 0 || wakeup < deadline)) {
+    deadline = wakeup;
+  }
+  if (deadline == client->armed_deadline_ms) {
+    return 0;
+  }
+  client->armed_deadline_ms = deadline;
+
+  long timeout_ms = -1;
+  if (deadline >= 0) {
+    int64_t until = deadline - chatty_now_ms();
+    timeout_ms = until > 0 ? (long)until : 0;
+  }
+  return client->loop_timer(timeout_ms, client->loop_data) == 0 ? 0 : -1;
+}
+
+static int chatty_loop_timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+  (void)multi;
+  chatty_Client *client = (chatty_Client *)userp;
+
+  client->curl_deadline_ms =
+      timeout_ms < 0 ? -1 : chatty_now_ms() + (int64_t)timeout_ms;
+  return chatty_loop_arm(client);
+}
+
+enum chatty_ERROR chatty_loop_attach(chatty_Client *client,
+                                     chatty_LoopSocketCallback on_socket,
+                                     chatty_LoopTimerCallback on_timer,
+                                     void *loop_data) {
+  // Switching drivers with transfers in flight would lose socket state
+  if (client == NULL || client->active != NULL ||
+      (on_socket == NULL) != (on_timer == NULL)) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  client->loop_socket = on_socket;
+  client->loop_timer = on_timer;
+  client->loop_data = loop_data;
+  client->curl_deadline_ms = -1;
+  client->armed_deadline_ms = -1;
+
+  if (on_socket != NULL) {
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETFUNCTION,
+                      chatty_loop_socket_cb);
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETDATA, (void *)client);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERFUNCTION,
+                      chatty_loop_timer_cb);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERDATA, (void *)client);
+    chatty_loop_arm(client);
+  } else {
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETFUNCTION, NULL);
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETDATA, NULL);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERFUNCTION, NULL);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERDATA, NULL);
+  }
+
+  return CHATTY_SUCCESS;
+}
+
+enum chatty_ERROR chatty_loop_socket_action(chatty_Client *client, int fd,
+                                            int events) {
+  if (client == NULL || client->loop_socket == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  int mask = 0;
+  if (events & CHATTY_LOOP_READ) {
+    mask |= CURL_CSELECT_IN;
+  }
+  if (events & CHATTY_LOOP_WRITE) {
+    mask |= CURL_CSELECT_OUT;
+  }
+
+  int running;
+  CURLMcode mc = curl_multi_socket_action(client->multi, (curl_socket_t)fd,
+                                          mask, &running);
+  chatty_client_reap(client);
+  chatty_client_service(client);
+  chatty_loop_arm(client);
+  return mc == CURLM_OK ? CHATTY_SUCCESS : CHATTY_CURL_NETWORK_ERROR;
+}
+
+enum chatty_ERROR chatty_loop_timeout(chatty_Client *client) {
+  if (client == NULL || client->loop_socket == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  // The host timer is one-shot, so nothing is armed anymore. An expired curl
+  // timeout is replaced through chatty_loop_timer_cb() if curl has another.
+  client->armed_deadline_ms = -1;
+  if (client->curl_deadline_ms >= 0 &&
+      client->curl_deadline_ms <= chatty_now_ms()) {
+    client->curl_deadline_ms = -1;
+  }
+
+  int running;
+  CURLMcode mc = curl_multi_socket_action(client->multi, CURL_SOCKET_TIMEOUT,
+                                          0, &running);
+  chatty_client_reap(client);
+  chatty_client_service(client);
+  chatty_loop_arm(client);
+  return mc == CURLM_OK ? CHATTY_SUCCESS : CHATTY_CURL_NETWORK_ERROR;
+}
+
+/* A non-zero return value indicates an error.
+   response will contain the response chat message.
+   You'll need to free response.message yourself. */
+enum chatty_ERROR chatty_client_chat(chatty_Client *client, int msgc,
+                                     chatty_Message msgv[],
+                                     chatty_Options options,
+                                     chatty_Message *response) {
+  // Input validation. Blocking would stall an attached event loop.
+  if (client == NULL || client->loop_socket != NULL || response == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  chatty_ClientEndpoint *endpoint;
+  enum chatty_ERROR error =
+      chatty_client_prepare(client, msgc, msgv, &options, &endpoint);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  // The call blocks until the request is done, so the body can be written
+  // from msgv as it is sent
+  chatty_SyncResult result = {false, CHATTY_SUCCESS, response};
+  chatty_Request *request;
+  error = chatty_client_start(client, endpoint, msgc, msgv, false, true,
+                              &options, NULL, NULL, chatty_sync_done,
+                              (void *)&result, &request);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  return chatty_client_wait(client, request, &result);
+}
+
+enum chatty_ERROR chatty_client_chat_stream(chatty_Client *client, int msgc,
+                                            chatty_Message msgv[],
+                                            chatty_Options options,
+                                            chatty_StreamCallback callback,
+                                            void *user_data) {
+  // Input validation. Blocking would stall an attached event loop.
+  if (client == NULL || client->loop_socket != NULL || callback == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  chatty_ClientEndpoint *endpoint;
+  enum chatty_ERROR error =
+      chatty_client_prepare(client, msgc, msgv, &options, &endpoint);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  chatty_SyncResult result = {false, CHATTY_SUCCESS, NULL};
+  chatty_Request *request;
+  error = chatty_client_start(client, endpoint, msgc, msgv, true, true,
+                              &options, callback, user_data, chatty_sync_done,
+                              (void *)&result, &request);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  return chatty_client_wait(client, request, &result);
+}
+
+enum chatty_ERROR chatty_client_warmup(chatty_Client *client) {
+  if (client == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  // An attached event loop finishes the probes on its own schedule
+  if (client->loop_socket != NULL) {
+    for (int i = 0; i < client->endpoint_count; i++) {
+      enum chatty_ERROR error =
+          chatty_client_probe(client, &client->endpoints[i], NULL, NULL, NULL);
+      if (error != CHATTY_SUCCESS) {
+        return error;
+      }
+    }
+    return CHATTY_SUCCESS;
+  }
+
+  // Probe every endpoint at once and wait for them in turn
+  chatty_SyncResult *results =
+      calloc(client->endpoint_count, sizeof(chatty_SyncResult));
+  chatty_Request **requests =
+      calloc(client->endpoint_count, sizeof(chatty_Request *));
+  if (results == NULL || requests == NULL) {
+    free(results);
+    free(requests);
+    return CHATTY_MEMORY_ERROR;
+  }
+  int started = 0;
+  enum chatty_ERROR error = CHATTY_SUCCESS;
+  for (; started < client->endpoint_count; started++) {
+    error = chatty_client_probe(client, &client->endpoints[started],
+                                chatty_sync_done, (void *)&results[started],
+                                &requests[started]);
+    if (error != CHATTY_SUCCESS) {
+      break;
+    }
+  }
+  for (int i = 0; i < started; i++) {
+    if (error != CHATTY_SUCCESS) {
+      if (!results[i].finished) {
+        chatty_client_cancel(client, requests[i]);
+      }
+      continue;
+    }
+    error = chatty_client_wait(client, requests[i], &results[i]);
+  }
+  free(results);
+  free(requests);
+  return error;
+}
+
+enum chatty_ERROR chatty_warmup(const char *base_url) {
+  chatty_ClientOptions options = {0};
+  options.base_url = base_url;
+
+  chatty_Client *client;
+  enum chatty_ERROR error = chatty_client_new(&options, &client);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  error = chatty_client_warmup(client);
+  chatty_client_free(client);
+  return error;
+}
+
+/* One-shot wrapper: resolves the provider and opens a fresh connection on
+   every call. Use a chatty_Client to reuse them. */
+enum chatty_ERROR chatty_chat(int msgc, chatty_Message msgv[],
+                              chatty_Options options,
+                              chatty_Message *response) {
+  // Input validation
+  if (response == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  enum chatty_ERROR error = chatty_validate_input(msgc, msgv, options);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  chatty_Client *client;
+  error = chatty_client_new(NULL, &client);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  error = chatty_client_chat(client, msgc, msgv, options, response);
+  chatty_client_free(client);
+  return error;
+}
+
+enum chatty_ERROR chatty_chat_stream(int msgc, chatty_Message msgv[],
+                                     chatty_Options options,
+                                     chatty_StreamCallback callback,
+                                     void *user_data) {
+  // Input validation
+  if (callback == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  enum chatty_ERROR error = chatty_validate_input(msgc, msgv, options);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  chatty_Client *client;
+  error = chatty_client_new(NULL, &client);
+  if (error != CHATTY_SUCCESS) {
+    return error;
+  }
+
+  error = chatty_client_chat_stream(client, msgc, msgv, options, callback,
+                                    user_data);
+  chatty_client_free(client);
+  return error;
+}
+
+enum chatty_ERROR chatty_endpoint_stats(const char *base_url,
+                                        chatty_EndpointStats *stats) {
+  if (stats == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  char *base_env = NULL;
+  if (base_url == NULL) {
+    base_env = curl_getenv("OPENAI_API_BASE");
+    base_url = base_env != NULL ? base_env : "https://api.openai.com/v1";
+  }
+  chatty_Upstream *upstream = chatty_get_upstream(base_url);
+  curl_free(base_env);
+  if (upstream == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+
+  pthread_mutex_lock(&chatty_upstreams_lock);
+  stats->concurrency_limit = (long)upstream->concurrency_limit;
+  stats->in_flight = upstream->in_flight;
+  stats->queued = upstream->queued;
+  stats->ttfb_p95_ms = (long)upstream->ttfb_p95_ms;
+  stats->circuit = upstream->circuit;
+  stats->error_rate =
+      upstream->breaker_count > 0
+          ? (double)upstream->breaker_failures / upstream->breaker_count
+          : 0;
+  stats->circuit_opens = upstream->circuit_opens;
+  pthread_mutex_unlock(&chatty_upstreams_lock);
+  return CHATTY_SUCCESS;
+}
+
+enum chatty_ERROR chatty_cancel_token_new(chatty_CancelToken **token) {
+  if (token == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  *token = calloc(1, sizeof(chatty_CancelToken));
+  if (*token == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  pthread_mutex_init(&(*token)->lock, NULL);
+  return CHATTY_SUCCESS;
+}
+
+void chatty_cancel_token_free(chatty_CancelToken *token) {
+  if (token == NULL) {
+    return;
+  }
+
+  pthread_mutex_destroy(&token->lock);
+  free(token->multis);
+  free(token);
+}
+
+void chatty_cancel(chatty_CancelToken *token) {
+  if (token == NULL) {
+    return;
+  }
+
+  // Waking a multi handle is thread-safe, unlike anything else on a client
+  pthread_mutex_lock(&token->lock);
+  token->cancelled = true;
+  for (int i = 0; i < token->multi_count; i++) {
+    curl_multi_wakeup(token->multis[i]);
+  }
+  pthread_mutex_unlock(&token->lock);
+}
+
+enum chatty_ERROR chatty_conversation_new(chatty_Conversation **conversation) {
+  if (conversation == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  *conversation = calloc(1, sizeof(chatty_Conversation));
+  return *conversation != NULL ? CHATTY_SUCCESS : CHATTY_MEMORY_ERROR;
+}
+
+/* Drop one reference to turn, freeing it and whatever history only it kept */
+static void chatty_turn_release(chatty_Turn *turn) {
+  pthread_mutex_lock(&chatty_conversation_lock);
+  while (turn != NULL && --turn->refs == 0) {
+    chatty_Turn *parent = turn->parent;
+    free(turn->json);
+    free(turn);
+    turn = parent;
+  }
+  pthread_mutex_unlock(&chatty_conversation_lock);
+}
+
+enum chatty_ERROR chatty_conversation_append(chatty_Conversation *conversation,
+                                             const chatty_Message *message) {
+  if (conversation == NULL || message == NULL ||
+      !chatty_message_valid(message)) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+  if (chatty_role_name(message->role) == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  // Measure first so the JSON is written without reallocating, images
+  // included, unless a file grows in between
+  chatty_Buffer json = {NULL, 0, 0};
+  size_t len = 0;
+  enum chatty_ERROR error =
+      chatty_measure_message(&json, 0, message, NULL, &len);
+  json.len = 0;
+  if (error == CHATTY_SUCCESS && !chatty_buffer_reserve(&json, len)) {
+    error = CHATTY_MEMORY_ERROR;
+  }
+  if (error == CHATTY_SUCCESS) {
+    error = chatty_write_message(&json, 0, message);
+  }
+  if (error == CHATTY_SUCCESS && json.cap > json.len + 1) {
+    // Turns are kept for the life of the conversation, so drop the slack
+    char *data = realloc(json.data, json.len + 1);
+    json.data = data != NULL ? data : json.data;
+  }
+  chatty_Turn *turn = NULL;
+  if (error == CHATTY_SUCCESS && (turn = malloc(sizeof(chatty_Turn))) == NULL) {
+    error = CHATTY_MEMORY_ERROR;
+  }
+  if (error != CHATTY_SUCCESS) {
+    free(json.data);
+    return error;
+  }
+
+  // The conversation's reference to its last turn passes to the new one
+  chatty_Turn *parent = conversation->last;
+  turn->json = json.data;
+  turn->parent = parent;
+  turn->refs = 1;
+  turn->count = parent != NULL ? parent->count + 1 : 1;
+  turn->start = parent != NULL ? parent->start + parent->len + 1 : 0;
+  turn->len = json.len;
+  conversation->last = turn;
+  return CHATTY_SUCCESS;
+}
+
+enum chatty_ERROR chatty_conversation_fork(
+    const chatty_Conversation *conversation, chatty_Conversation **fork) {
+  if (conversation == NULL || fork == NULL) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+
+  *fork = malloc(sizeof(chatty_Conversation));
+  if (*fork == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  (*fork)->last = conversation->last;
+  if ((*fork)->last != NULL) {
+    pthread_mutex_lock(&chatty_conversation_lock);
+    (*fork)->last->refs++;
+    pthread_mutex_unlock(&chatty_conversation_lock);
+  }
+  return CHATTY_SUCCESS;
+}
+
+int chatty_conversation_length(const chatty_Conversation *conversation) {
+  return conversation != NULL && conversation->last != NULL
+             ? conversation->last->count
+             : 0;
+}
+
+void chatty_conversation_free(chatty_Conversation *conversation) {
+  if (conversation == NULL) {
+    return;
+  }
+
+  chatty_turn_release(conversation->last);
+  free(conversation);
+}
+
+/* Append json as compact JSON after checking it is of the expected type */
+static enum chatty_ERROR chatty_append_schema(chatty_Buffer *out,
+                                             const char *name,
+                                             const char *json,
+                                             cJSON_bool (*is_type)(
+                                                 const cJSON *item)) {
+  cJSON *schema = cJSON_Parse(json);
+  if (schema == NULL || !is_type(schema)) {
+    cJSON_Delete(schema);
+    return CHATTY_INVALID_OPTIONS;
+  }
+  char *compact = cJSON_PrintUnformatted(schema);
+  cJSON_Delete(schema);
+  bool ok = compact != NULL && chatty_buffer_append_str(out, ",\"") &&
+            chatty_buffer_append_str(out, name) &&
+            chatty_buffer_append_str(out, "\":") &&
+            chatty_buffer_append_str(out, compact);
+  cJSON_free(compact);
+  return ok ? CHATTY_SUCCESS : CHATTY_MEMORY_ERROR;
+}
+
+enum chatty_ERROR chatty_template_new(int msgc, chatty_Message msgv[],
+                                      chatty_Options options,
+                                      const char *tools,
+                                      const char *response_format,
+                                      chatty_Template **request_template) {
+  if (request_template == NULL || msgc < 0 || (msgc > 0 && msgv == NULL) ||
+      options.model == NULL || strlen(options.model) == 0 ||
+      !chatty_sampling_valid(&options)) {
+    return CHATTY_INVALID_OPTIONS;
+  }
+  for (int i = 0; i < msgc; i++) {
+    if (!chatty_message_valid(&msgv[i]) ||
+        chatty_role_name(msgv[i].role) == NULL) {
+      return CHATTY_INVALID_OPTIONS;
+    }
   }
 
-  if (stream_ctx.error_occurred) {
-    return CHATTY_STREAM_CALLBACK_ERROR;
+  chatty_Template *compiled = calloc(1, sizeof(chatty_Template));
+  if (compiled == NULL) {
+    return CHATTY_MEMORY_ERROR;
+  }
+  chatty_Buffer *json = &compiled->json;
+  compiled->count = msgc;
+
+  enum chatty_ERROR error = CHATTY_MEMORY_ERROR;
+  if (!chatty_buffer_append_str(json, "{\"messages\":[") ||
+      (error = chatty_write_messages(json, 0, msgc, msgv)) != CHATTY_SUCCESS) {
+    goto fail;
+  }
+  error = CHATTY_MEMORY_ERROR;
+  compiled->head_len = json->len;
+  if (!chatty_buffer_append_json_string(json, options.model,
+                                        strlen(options.model))) {
+    goto fail;
   }
+  compiled->model_len = json->len - compiled->head_len;
+  if (!chatty_write_sampling(json, &options)) {
+    goto fail;
+  }
+  if (tools != NULL &&
+      (error = chatty_append_schema(json, "tools", tools, cJSON_IsArray)) !=
+          CHATTY_SUCCESS) {
+    goto fail;
+  }
+  if (response_format != NULL &&
+      (error = chatty_append_schema(json, "response_format", response_format,
+                                    cJSON_IsObject)) != CHATTY_SUCCESS) {
+    goto fail;
+  }
+  compiled->tail_len = json->len - compiled->head_len - compiled->model_len;
 
+  *request_template = compiled;
   return CHATTY_SUCCESS;
+
+fail:
+  free(json->data);
+  free(compiled);
+  return error;
+}
+
+void chatty_template_free(chatty_Template *request_template) {
+  if (request_template == NULL) {
+    return;
+  }
+
+  free(request_template->json.data);
+  free(request_template);
 }
 
 const char *chatty_error_string(enum chatty_ERROR error) {
@@ -568,6 +4914,16 @@ const char *chatty_error_string(enum chatty_ERROR error) {
     return "Stream callback returned error";
   case CHATTY_STREAM_PARSE_ERROR:
     return "Failed to parse streaming response";
+  case CHATTY_CANCELLED:
+    return "Request was cancelled";
+  case CHATTY_TIMEOUT:
+    return "Request timed out";
+  case CHATTY_STREAM_STALLED:
+    return "Stream stalled";
+  case CHATTY_CIRCUIT_OPEN:
+    return "Circuit breaker open";
+  case CHATTY_FILE_ERROR:
+    return "Could not read file";
   default:
     return "Unknown error";
   }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <sys/uio.h>
 
 enum chatty_Role
 {
@@ -21,12 +22,53 @@ enum chatty_ERROR
     CHATTY_MEMORY_ERROR,
     CHATTY_STREAM_CALLBACK_ERROR,
     CHATTY_STREAM_PARSE_ERROR,
+    CHATTY_CANCELLED,
+    CHATTY_TIMEOUT,
+    CHATTY_STREAM_STALLED,
+    CHATTY_CIRCUIT_OPEN,
+    CHATTY_FILE_ERROR,
 };
 
+enum chatty_CircuitState
+{
+    CHATTY_CIRCUIT_STATE_CLOSED,
+    CHATTY_CIRCUIT_STATE_OPEN,      /* Requests fail fast or go to another endpoint */
+    CHATTY_CIRCUIT_STATE_HALF_OPEN, /* A trial request is out to see if it recovered */
+};
+
+/* Lets another thread abort the requests it was handed to, see chatty_cancel() */
+typedef struct chatty_CancelToken chatty_CancelToken;
+
+/* Chat history kept in serialized form, see chatty_conversation_new() */
+typedef struct chatty_Conversation chatty_Conversation;
+
+/* Fixed parts of a request serialized ahead of time, see chatty_template_new() */
+typedef struct chatty_Template chatty_Template;
+
+/* An image sent along with a message. The file is mapped and base64 encoded
+   straight into the request body when the request is serialized, so it must
+   not change until then (until a blocking call returns). */
+typedef struct chatty_Image
+{
+    const char *path;      /* NULL to read fd instead */
+    int fd;                /* Read from its start and left open */
+    const char *mime_type; /* NULL guesses it from the extension of path */
+} chatty_Image;
+
+/* Should be 0 initialized. By default message is a NUL terminated string. The
+   text can also be given as a length, or as segments sent one after the other
+   with iov, in which case message is ignored. It is read in place, so neither
+   needs a NUL terminator and both may contain NUL bytes. */
 typedef struct chatty_Message
 {
     enum chatty_Role role;
     char *message;
+    bool has_length; /* message is length bytes long */
+    size_t length;
+    const struct iovec *iov;
+    int iovcnt;
+    const chatty_Image *images; /* Sent after the text, which may then be empty */
+    int image_count;
 } chatty_Message;
 
 /* model is required. Should be 0 initialized using memset. */
@@ -37,6 +79,24 @@ typedef struct chatty_Options
     double temperature;
     bool has_top_p; /* Same for top_p, 0 is also a valid top_p */
     double top_p;
+    /* Per-request limits. 0 means no limit. timeout_ms bounds the whole
+       request, retries and backoff included, and fails it with
+       CHATTY_TIMEOUT. connect_timeout_ms bounds each connection attempt. */
+    long timeout_ms;
+    long connect_timeout_ms;
+    chatty_CancelToken *cancel; /* Optional, must outlive the request */
+    /* Streams only. Fails the request with CHATTY_STREAM_STALLED when this
+       many milliseconds pass without a data: event, the wait for the first
+       one included. A stall before the callback has seen anything is
+       retried like a dropped connection. 0 means no limit. */
+    long stream_idle_timeout_ms;
+    /* Optional. Its messages are sent ahead of msgv without being escaped
+       again, and msgc may be 0. */
+    const chatty_Conversation *conversation;
+    /* Optional. Its messages go first, and its sampling parameters and
+       schemas are sent instead of the ones above. Its model is used when
+       model is NULL and the endpoint has no name of its own for it. */
+    const chatty_Template *request_template;
 } chatty_Options;
 
 typedef enum chatty_StreamStatus
@@ -48,9 +108,251 @@ typedef enum chatty_StreamStatus
 
 typedef int (*chatty_StreamCallback)(const char *content, chatty_StreamStatus status, void *user_data);
 
+/* A long-lived client. It resolves the provider configuration once and keeps
+   its curl handles, and with them the connection, DNS and TLS session caches,
+   across calls, so back-to-back requests reuse a warm keep-alive connection.
+   A client must only be used by one thread at a time. */
+typedef struct chatty_Client chatty_Client;
+
+/* An in-flight request submitted with chatty_client_submit*(). The handle is
+   only valid until its completion callback returns. */
+typedef struct chatty_Request chatty_Request;
+
+/* Called exactly once per submitted request. On success of a buffered request
+   response holds the reply and you'll need to free response->message yourself.
+   For stream requests, and on errors, response is NULL. */
+typedef void (*chatty_CompletionCallback)(chatty_Request *request, enum chatty_ERROR error, chatty_Message *response, void *user_data);
+
+/* One of several providers serving the same model. Should be 0 initialized. */
+typedef struct chatty_Endpoint
+{
+    const char *base_url; /* Required */
+    const char *api_key;  /* Defaults to the provider's *_API_KEY variable */
+    const char *model;    /* The provider's name for the model, NULL for chatty_Options.model */
+    double weight;        /* Preference over the other endpoints, 0 for 1 */
+    bool backup;          /* Only used while the circuits of all others are open */
+    const char *const *api_keys; /* Pool of keys to use instead of api_key, see chatty_ClientOptions */
+    int api_key_count;
+} chatty_Endpoint;
+
+/* Should be 0 initialized using memset. NULL fields are resolved from the
+   environment the same way chatty_chat() does it. The environment is read
+   once per process, the first time both base_url and api_key are NULL.
+   Strings are copied. */
+typedef struct chatty_ClientOptions
+{
+    const char *base_url; /* Defaults to OPENAI_API_BASE, then OpenAI */
+    const char *api_key;  /* Defaults to the provider's *_API_KEY variable */
+    /* Pool of keys to use instead of api_key, for instance from several
+       organizations. Each request takes the key with the most quota left
+       according to the provider's x-ratelimit-* headers, and a key that got
+       a 429 is skipped until its Retry-After. */
+    const char *const *api_keys;
+    int api_key_count;
+    /* Concurrent requests to an HTTPS base URL are multiplexed as HTTP/2
+       streams over shared connections. Requests beyond both limits queue
+       inside the client until a stream frees up. */
+    long max_host_connections;   /* Connections per host, 0 for no limit */
+    long max_concurrent_streams; /* Streams per connection, 0 for curl's default of 100 */
+    /* By default DNS results and TLS sessions go into a cache shared by every
+       client in the process, across threads. Set to keep them to this client. */
+    bool isolated_cache;
+    /* When > 0, an idle client sends a cheap HEAD request after this many
+       milliseconds without traffic so its pooled connection doesn't go cold.
+       Probes only go out while the client is driven, by chatty_client_perform()
+       or an attached event loop. */
+    long keep_warm_ms;
+    /* Opt-in file that carries resolved addresses and TLS session tickets
+       across process restarts, so the next process skips DNS and resumes
+       with an abbreviated handshake. Defaults to CHATTY_CACHE_FILE, read once
+       per process. TLS sessions need libcurl 8.12 and the shared cache. */
+    const char *cache_path;
+    /* Requests that fail with 408, 429, 500, 502, 503, 504 or a broken
+       connection are sent again, with exponential backoff and jitter, and
+       never before the provider's Retry-After. Streams are only retried
+       until their callback has seen the first chunk. Retries draw on a
+       budget per base URL, shared by every client in the process, that
+       successes refill, so an outage can't multiply the load on the
+       provider. */
+    int max_retries;    /* Retries per request, 0 for the default of 2, -1 for none */
+    long retry_base_ms; /* First backoff, 0 for 500 */
+    long retry_max_ms;  /* Longest backoff and Retry-After we wait out, 0 for 30000 */
+    /* Opt-in hedging against slow upstreams. A request that has not seen the
+       first byte of its reply after this many milliseconds is raced by an
+       identical one, and whichever answers first wins while the other is
+       cancelled. -1 uses the p95 time to first byte observed on the base URL
+       across the process, once enough requests completed. At most 5% of
+       requests are hedged. Defaults to CHATTY_HEDGE_DELAY_MS, read once per
+       process. 0 disables. */
+    long hedge_delay_ms;
+    /* Requests are paced ahead of time to stay under the request and token
+       limits the provider reports in its x-ratelimit-* headers. What one
+       client learns applies to every client of the same base URL in the
+       process. Set to send requests as soon as they are submitted. */
+    bool ignore_rate_limits;
+    /* Limit the requests in flight to the base URL, across every client in
+       the process that sets this, with a limit that adapts to the
+       provider: it grows while requests succeed quickly and backs off on
+       429s, timeouts and rising time to first byte. Requests over the limit
+       wait in the client until a slot frees up. */
+    bool adaptive_concurrency;
+    /* Route requests between several providers instead of base_url and
+       api_key. Each request goes to the endpoint with the lowest recent time
+       to first byte, penalized by its recent error rate and scaled by its
+       weight. A few requests go elsewhere at random to keep the numbers of
+       the other endpoints current. Retries stay on the request's endpoint. */
+    const chatty_Endpoint *endpoints;
+    int endpoint_count;
+    /* Opt-in circuit breaker per base URL, its state shared by every client
+       in the process that sets this. The circuit opens when the share of the
+       recent attempts that failed, or were slower than breaker_slow_ms to
+       their first byte, reaches breaker_error_rate. While open, requests go
+       to another endpoint or fail with CHATTY_CIRCUIT_OPEN right away. After
+       breaker_open_ms one trial request goes through: success closes the
+       circuit, failure keeps it open for another period. */
+    bool circuit_breaker;
+    double breaker_error_rate; /* 0 for 0.5 */
+    long breaker_slow_ms;      /* 0 for no latency limit */
+    long breaker_open_ms;      /* 0 for 5000 */
+} chatty_ClientOptions;
+
+/* What libchatty currently knows about a provider, for monitoring */
+typedef struct chatty_EndpointStats
+{
+    long concurrency_limit; /* Adaptive limit on requests in flight */
+    long in_flight;         /* Requests holding a slot of that limit */
+    long queued;            /* Requests waiting for a slot */
+    long ttfb_p95_ms;       /* Recent p95 time to first byte, -1 while unknown */
+    enum chatty_CircuitState circuit;
+    double error_rate;      /* Share of the recent attempts the breaker counts as failed */
+    long circuit_opens;     /* Times the circuit opened since the process started */
+} chatty_EndpointStats;
+
 enum chatty_ERROR chatty_chat(int msgc, chatty_Message msgv[], chatty_Options options, chatty_Message *response);
 
 enum chatty_ERROR chatty_chat_stream(int msgc, chatty_Message msgv[], chatty_Options options, chatty_StreamCallback callback, void *user_data);
 
+/* The compact JSON body chatty_chat() would send. The caller frees it. NULL if
+   options or a role is invalid or memory runs out. */
+char *chatty_to_json_string(int msgc, chatty_Message msgv[], chatty_Options options, bool stream);
+
+/* options may be NULL. On success *client must be released with chatty_client_free(). */
+enum chatty_ERROR chatty_client_new(const chatty_ClientOptions *options, chatty_Client **client);
+
+void chatty_client_free(chatty_Client *client);
+
+/* Same as chatty_chat() and chatty_chat_stream(), but on the client's pooled connection.
+   When the messages add up to a megabyte or more, the request body is written
+   from msgv piece by piece as it is uploaded instead of being built up front. */
+enum chatty_ERROR chatty_client_chat(chatty_Client *client, int msgc, chatty_Message msgv[], chatty_Options options, chatty_Message *response);
+
+enum chatty_ERROR chatty_client_chat_stream(chatty_Client *client, int msgc, chatty_Message msgv[], chatty_Options options, chatty_StreamCallback callback, void *user_data);
+
+/* Non-blocking variants. The messages are serialized before these return, so
+   msgv does not need to outlive the call. Nothing is sent until the client is
+   driven with chatty_client_perform(). request may be NULL. */
+enum chatty_ERROR chatty_client_submit(chatty_Client *client, int msgc, chatty_Message msgv[], chatty_Options options, chatty_CompletionCallback done, void *user_data, chatty_Request **request);
+
+/* user_data is passed to both callback and done. done may be NULL. */
+enum chatty_ERROR chatty_client_submit_stream(chatty_Client *client, int msgc, chatty_Message msgv[], chatty_Options options, chatty_StreamCallback callback, chatty_CompletionCallback done, void *user_data, chatty_Request **request);
+
+/* Waits up to timeout_ms for network activity on the submitted requests,
+   advances all of them and invokes the callbacks of those that finished.
+   running, if not NULL, receives the number of requests still in flight.
+   Returns immediately when nothing is in flight. The synchronous
+   chatty_client_chat*() calls drive other submitted requests as well. */
+enum chatty_ERROR chatty_client_perform(chatty_Client *client, int timeout_ms, int *running);
+
+/* Aborts an in-flight request. Its completion callback runs before this
+   returns, with CHATTY_CANCELLED. Not to be called from a stream callback;
+   return non-zero from the callback instead. */
+enum chatty_ERROR chatty_client_cancel(chatty_Client *client, chatty_Request *request);
+
+/* Establishes and pools a connection to the client's provider ahead of the
+   first request, taking DNS, TCP and TLS off its critical path. Blocks until
+   connected, unless an event loop is attached, in which case the connection
+   is opened in the background. */
+enum chatty_ERROR chatty_client_warmup(chatty_Client *client);
+
+/* Resolves and handshakes with base_url (NULL for OPENAI_API_BASE), filling
+   the process-wide DNS and TLS session cache so later calls, including
+   one-shot chatty_chat() calls, resume instead of negotiating from scratch. */
+enum chatty_ERROR chatty_warmup(const char *base_url);
+
+/* Socket interest reported to an external event loop */
+enum chatty_LoopEvent
+{
+    CHATTY_LOOP_NONE = 0, /* Stop watching the socket */
+    CHATTY_LOOP_READ = 1,
+    CHATTY_LOOP_WRITE = 2,
+};
+
+/* Start watching fd for events (a chatty_LoopEvent mask), replacing any
+   previous interest. Return 0 on success. */
+typedef int (*chatty_LoopSocketCallback)(int fd, int events, void *loop_data);
+
+/* (Re)arm the single one-shot timer of the client to fire in timeout_ms.
+   -1 disarms it, 0 means call chatty_loop_timeout() as soon as possible.
+   Return 0 on success. */
+typedef int (*chatty_LoopTimerCallback)(long timeout_ms, void *loop_data);
+
+/* Hand the client's sockets and timeouts to an existing event loop (epoll,
+   kqueue, libuv...), so submitted requests run without extra threads or
+   polling. Must be called while nothing is in flight. Pass NULL callbacks to
+   detach. While attached, chatty_client_perform() and the blocking
+   chatty_client_chat*() calls return CHATTY_INVALID_OPTIONS. */
+enum chatty_ERROR chatty_loop_attach(chatty_Client *client, chatty_LoopSocketCallback on_socket, chatty_LoopTimerCallback on_timer, void *loop_data);
+
+/* Call when a watched socket is ready. Completion callbacks run from here. */
+enum chatty_ERROR chatty_loop_socket_action(chatty_Client *client, int fd, int events);
+
+/* Call when the timer armed through chatty_LoopTimerCallback fires. */
+enum chatty_ERROR chatty_loop_timeout(chatty_Client *client);
+
+/* On success *token must be released with chatty_cancel_token_free(), after
+   every request using it has finished. */
+enum chatty_ERROR chatty_cancel_token_new(chatty_CancelToken **token);
+
+void chatty_cancel_token_free(chatty_CancelToken *token);
+
+/* Aborts every request using token, now and in the future, with
+   CHATTY_CANCELLED. Safe to call from any thread, any number of times. A
+   blocked chatty_chat*() or chatty_client_perform() wakes up right away;
+   with an attached event loop the transfer stops the next time the loop
+   drives it. */
+void chatty_cancel(chatty_CancelToken *token);
+
+/* On success *conversation must be released with chatty_conversation_free().
+   Pass it through chatty_Options.conversation to send its messages. */
+enum chatty_ERROR chatty_conversation_new(chatty_Conversation **conversation);
+
+/* Serializes message once, so every later request only copies it. The
+   message is not referenced afterwards. */
+enum chatty_ERROR chatty_conversation_append(chatty_Conversation *conversation, const chatty_Message *message);
+
+/* Creates a conversation with the same messages in O(1). Both share them and
+   can be appended to independently. A conversation is not thread-safe, but
+   it and its forks may be used on different threads. */
+enum chatty_ERROR chatty_conversation_fork(const chatty_Conversation *conversation, chatty_Conversation **fork);
+
+int chatty_conversation_length(const chatty_Conversation *conversation);
+
+void chatty_conversation_free(chatty_Conversation *conversation);
+
+/* Serializes what many requests have in common once: msgv (typically the
+   system prompt), the model and sampling parameters of options, and the
+   tools array and response_format object given as JSON text, either of
+   which may be NULL. Requests using it through chatty_Options.request_template
+   then copy these bytes instead of building them. A template is never
+   modified, so any number of requests and threads may share it. On success
+   *request_template must be released with chatty_template_free(). */
+enum chatty_ERROR chatty_template_new(int msgc, chatty_Message msgv[], chatty_Options options, const char *tools, const char *response_format, chatty_Template **request_template);
+
+void chatty_template_free(chatty_Template *request_template);
+
+/* Fills stats for base_url, NULL for OPENAI_API_BASE. Safe to call from
+   any thread. */
+enum chatty_ERROR chatty_endpoint_stats(const char *base_url, chatty_EndpointStats *stats);
+
 /* Get string representation of error code */
 const char *chatty_error_string(enum chatty_ERROR error);
\ No newline at end of file
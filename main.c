@@ -61,7 +61,7 @@ int main(int argc, char *argv[])
         }
     }
     
-    chatty_Message messages[1];
+    chatty_Message messages[1] = {0};
     messages[0].role = CHATTY_USER;
 
     // Parse message argument (accounting for streaming flag offset)
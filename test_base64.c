@@ -0,0 +1,87 @@
+// Built from chatty.c itself to reach its static encoders
+#include "chatty.c"
+
+// The SSSE3 and AVX2 base64 encoders must write exactly what the scalar one
+// does, for every length around their 12 and 24 byte steps, the 16 and 32
+// byte loads they can't make near the end, and the padded tail.
+
+#ifdef CHATTY_HAVE_X86_SIMD
+
+#define MAX_LEN 200
+
+static int check(const char *name, chatty_Base64Encode encode, const unsigned char *in, size_t len)
+{
+    // Larger than needed, so a write past the end shows up
+    static char expected[MAX_LEN * 2], found[MAX_LEN * 2];
+    memset(expected, '?', sizeof(expected));
+    memset(found, '?', sizeof(found));
+    size_t expected_len = chatty_base64_scalar(expected, in, len);
+    size_t found_len = encode(found, in, len);
+    if (found_len != expected_len || memcmp(found, expected, sizeof(found)) != 0)
+    {
+        fprintf(stderr, "%s: length %zu, wrote %.*s instead of %.*s\n", name, len, (int)found_len, found,
+                (int)expected_len, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    // The scalar encoder is the reference, so pin it to RFC 4648 first
+    static const char *const vectors[][2] = {{"", ""},         {"f", "Zg=="},         {"fo", "Zm8="},
+                                             {"foo", "Zm9v"}, {"foob", "Zm9vYg=="}, {"fooba", "Zm9vYmE="},
+                                             {"foobar", "Zm9vYmFy"}};
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+    {
+        char out[16];
+        size_t len = chatty_base64_scalar(out, (const unsigned char *)vectors[i][0], strlen(vectors[i][0]));
+        if (len != strlen(vectors[i][1]) || memcmp(out, vectors[i][1], len) != 0)
+        {
+            fprintf(stderr, "scalar: \"%s\" wrote %.*s instead of %s\n", vectors[i][0], (int)len, out, vectors[i][1]);
+            failures++;
+        }
+    }
+
+    __builtin_cpu_init();
+    bool have_ssse3 = __builtin_cpu_supports("ssse3");
+    bool have_avx2 = __builtin_cpu_supports("avx2");
+    // Room to start at every offset of a 32 byte block
+    static unsigned char buffer[MAX_LEN + 32];
+    srand(25);
+    for (int round = 0; round < 50; round++)
+    {
+        // Counting bytes first, then random ones
+        for (size_t i = 0; i < sizeof(buffer); i++)
+        {
+            buffer[i] = round == 0 ? (unsigned char)i : (unsigned char)rand();
+        }
+        for (size_t offset = 0; offset < 32; offset++)
+        {
+            for (size_t len = 0; len <= MAX_LEN; len++)
+            {
+                if (have_ssse3)
+                {
+                    failures += check("ssse3", chatty_base64_ssse3, buffer + offset, len);
+                }
+                if (have_avx2)
+                {
+                    failures += check("avx2", chatty_base64_avx2, buffer + offset, len);
+                }
+            }
+        }
+    }
+
+    return failures != 0;
+}
+
+#else
+
+int main(void)
+{
+    printf("No SIMD base64 encoder on this platform, skipping\n");
+    return 77;
+}
+
+#endif
@@ -0,0 +1,94 @@
+// Built from chatty.c itself to reach its static scanners
+#include "chatty.c"
+
+// The SSE2 and AVX2 escape scans must find the same first escape as the
+// scalar one, wherever it falls relative to their 16 and 32 byte steps and
+// in the tails they leave to the scalar loop.
+
+#ifdef CHATTY_HAVE_X86_SIMD
+
+#define MAX_LEN 200
+
+static int check(const char *name, chatty_EscapeScan scan, const char *text, size_t len)
+{
+    size_t expected = chatty_escape_scan_scalar(text, len);
+    size_t found = scan(text, len);
+    if (found != expected)
+    {
+        fprintf(stderr, "%s: length %zu, escape at %zu, found %zu\n", name, len, expected, found);
+        return 1;
+    }
+    return 0;
+}
+
+static bool have_avx2;
+
+static int check_all(const char *text, size_t len)
+{
+    int failures = check("sse2", chatty_escape_scan_sse2, text, len);
+    if (have_avx2)
+    {
+        failures += check("avx2", chatty_escape_scan_avx2, text, len);
+    }
+    return failures;
+}
+
+int main(void)
+{
+    // Room to start at every offset of a 32 byte block
+    static char buffer[MAX_LEN + 32];
+    static const unsigned char escapes[] = {'"', '\\', 0x00, 0x1f, '\n'};
+    // Bytes that are close to, but not, what needs escaping
+    static const unsigned char clean[] = {' ', '!', '#', '[', ']', 0x7f, 0x80, 0xff};
+    int failures = 0;
+    __builtin_cpu_init();
+    have_avx2 = __builtin_cpu_supports("avx2");
+
+    for (size_t offset = 0; offset < 32; offset++)
+    {
+        char *text = buffer + offset;
+        for (size_t len = 0; len <= MAX_LEN; len++)
+        {
+            for (size_t i = 0; i < len; i++)
+            {
+                text[i] = (char)clean[(i + len) % sizeof(clean)];
+            }
+            failures += check_all(text, len);
+
+            // One escape at every position, boundaries and tails included
+            for (size_t at = 0; at < len; at++)
+            {
+                for (size_t e = 0; e < sizeof(escapes); e++)
+                {
+                    text[at] = (char)escapes[e];
+                    failures += check_all(text, len);
+                }
+                text[at] = (char)clean[(at + len) % sizeof(clean)];
+            }
+        }
+    }
+
+    // Several escapes in one block, only the first counts
+    srand(20);
+    for (int round = 0; round < 100000; round++)
+    {
+        size_t len = (size_t)rand() % (MAX_LEN + 1);
+        for (size_t i = 0; i < len; i++)
+        {
+            buffer[i] = (char)(rand() % 16 == 0 ? rand() % 256 : 0x20 + rand() % 96);
+        }
+        failures += check_all(buffer, len);
+    }
+
+    return failures != 0;
+}
+
+#else
+
+int main(void)
+{
+    printf("No SIMD escape scan on this platform, skipping\n");
+    return 77;
+}
+
+#endif
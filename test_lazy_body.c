@@ -0,0 +1,259 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "chatty.h"
+
+// A blocking call with more than a megabyte of messages writes its body
+// while it uploads instead of serializing it first. What reaches the
+// provider must be byte for byte what chatty_to_json_string() builds, with
+// text segments that need escaping and images read from a path and an fd.
+
+#define TEXT_LEN (1536 * 1024)
+#define IMAGE_LEN (300 * 1024 + 1)
+
+static int listener;
+static char *received;
+static size_t received_len;
+
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Serves one request, keeping its body, and answers with a short reply
+static void *serve(void *arg)
+{
+    (void)arg;
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    size_t cap = 64 * 1024, len = 0, body_at = 0, content_length = 0;
+    char *request = malloc(cap + 1);
+    while (request != NULL)
+    {
+        if (len == cap)
+        {
+            char *grown = realloc(request, 2 * cap + 1);
+            if (grown == NULL)
+            {
+                break;
+            }
+            request = grown;
+            cap *= 2;
+        }
+        ssize_t n = recv(fd, request + len, cap - len, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        len += (size_t)n;
+        request[len] = '\0';
+        if (body_at == 0)
+        {
+            char *end = strstr(request, "\r\n\r\n");
+            if (end == NULL)
+            {
+                continue;
+            }
+            body_at = (size_t)(end + 4 - request);
+            for (char *line = strstr(request, "\r\n"); line != NULL && line < end; line = strstr(line + 2, "\r\n"))
+            {
+                if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+                {
+                    content_length = strtoul(line + 17, NULL, 10);
+                }
+                else if (strncasecmp(line + 2, "Expect: 100-continue", 20) == 0)
+                {
+                    send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+                }
+            }
+        }
+        if (len - body_at >= content_length)
+        {
+            received_len = len - body_at;
+            received = malloc(received_len + 1);
+            if (received != NULL)
+            {
+                memcpy(received, request + body_at, received_len);
+            }
+            break;
+        }
+    }
+    free(request);
+
+    static const char reply[] = "{\"choices\":[{\"message\":{\"role\":\"assistant\",\"content\":\"ok\"}}]}";
+    char head[128];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                            sizeof(reply) - 1);
+    send_all(fd, head, (size_t)head_len);
+    send_all(fd, reply, sizeof(reply) - 1);
+    close(fd);
+    return NULL;
+}
+
+// An image file of bytes that cover every base64 character, unlinked once open
+static int write_image(char *path)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unsigned char *data = malloc(IMAGE_LEN);
+    if (data == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    srand(21);
+    for (size_t i = 0; i < IMAGE_LEN; i++)
+    {
+        data[i] = (unsigned char)rand();
+    }
+    size_t written = 0;
+    while (written < IMAGE_LEN)
+    {
+        ssize_t n = write(fd, data + written, IMAGE_LEN - written);
+        if (n <= 0)
+        {
+            break;
+        }
+        written += (size_t)n;
+    }
+    free(data);
+    return written == IMAGE_LEN ? fd : -1;
+}
+
+int main(void)
+{
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    pthread_t server;
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        pthread_create(&server, NULL, serve, NULL) != 0)
+    {
+        perror("Could not start the local server");
+        return 1;
+    }
+
+    // Quotes, backslashes, control characters and UTF-8 spread over the text
+    char *text = malloc(TEXT_LEN);
+    if (text == NULL)
+    {
+        return 1;
+    }
+    static const char pattern[] = "Plain words \"quoted\" C:\\path\ttab\nline \x01 caf\xc3\xa9 ";
+    for (size_t i = 0; i < TEXT_LEN; i++)
+    {
+        text[i] = pattern[i % (sizeof(pattern) - 1)];
+    }
+    struct iovec segments[3] = {
+        {text, TEXT_LEN / 3}, {text + TEXT_LEN / 3, 7}, {text + TEXT_LEN / 3 + 7, TEXT_LEN - TEXT_LEN / 3 - 7}};
+
+    char image_path[] = "/tmp/chatty_test_lazy_body_XXXXXX";
+    int image_fd = write_image(image_path);
+    if (image_fd < 0)
+    {
+        perror("Could not write the test image");
+        return 1;
+    }
+    chatty_Image images[2] = {{image_path, -1, "image/png"}, {NULL, image_fd, "image/jpeg"}};
+
+    chatty_Message messages[3];
+    memset(messages, 0, sizeof(messages));
+    messages[0].role = CHATTY_SYSTEM;
+    messages[0].message = "You describe pictures.";
+    messages[1].role = CHATTY_USER;
+    messages[1].iov = segments;
+    messages[1].iovcnt = 3;
+    messages[2].role = CHATTY_USER;
+    messages[2].message = "And these?";
+    messages[2].images = images;
+    messages[2].image_count = 2;
+    chatty_Options options;
+    memset(&options, 0, sizeof(options));
+    options.model = "test";
+    options.has_temperature = true;
+    options.temperature = 0.5;
+
+    char *expected = chatty_to_json_string(3, messages, options, false);
+    if (expected == NULL)
+    {
+        fprintf(stderr, "Could not serialize the request\n");
+        return 1;
+    }
+
+    char base_url[64];
+    snprintf(base_url, sizeof(base_url), "http://127.0.0.1:%d", ntohs(addr.sin_port));
+    chatty_ClientOptions client_options;
+    memset(&client_options, 0, sizeof(client_options));
+    client_options.base_url = base_url;
+    client_options.api_key = "test";
+    client_options.max_retries = -1;
+    chatty_Client *client;
+    if (chatty_client_new(&client_options, &client) != CHATTY_SUCCESS)
+    {
+        fprintf(stderr, "Could not create the client\n");
+        return 1;
+    }
+    chatty_Message response;
+    enum chatty_ERROR error = chatty_client_chat(client, 3, messages, options, &response);
+    chatty_client_free(client);
+    pthread_join(server, NULL);
+    unlink(image_path);
+    close(image_fd);
+
+    int failed = 0;
+    if (error != CHATTY_SUCCESS)
+    {
+        fprintf(stderr, "Request failed: %s\n", chatty_error_string(error));
+        failed = 1;
+    }
+    else
+    {
+        free(response.message);
+    }
+    size_t expected_len = strlen(expected);
+    if (received == NULL || received_len != expected_len || memcmp(received, expected, expected_len) != 0)
+    {
+        size_t at = 0;
+        while (received != NULL && at < received_len && at < expected_len && received[at] == expected[at])
+        {
+            at++;
+        }
+        fprintf(stderr, "Sent %zu bytes instead of %zu, first difference at %zu\n", received_len, expected_len, at);
+        failed = 1;
+    }
+    free(received);
+    free(expected);
+    free(text);
+    return failed;
+}
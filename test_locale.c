@@ -0,0 +1,53 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chatty.h"
+
+// Request bodies must be valid JSON whatever the caller's locale. printf
+// writes 0.7 as "0,7" where the decimal separator is a comma.
+
+int main(void)
+{
+    static const char *locales[] = {"de_DE.UTF-8", "de_DE.utf8", "de_DE",
+                                    "fr_FR.UTF-8", "fr_FR.utf8", "fr_FR"};
+    const char *name = NULL;
+    for (size_t i = 0; i < sizeof(locales) / sizeof(locales[0]) && name == NULL; i++)
+    {
+        name = setlocale(LC_NUMERIC, locales[i]);
+    }
+    if (name == NULL || localeconv()->decimal_point[0] != ',')
+    {
+        printf("No comma-decimal locale installed, skipping\n");
+        return 77;
+    }
+
+    chatty_Message message = {0};
+    message.role = CHATTY_USER;
+    message.message = "hi";
+    chatty_Options options;
+    memset(&options, 0, sizeof(options));
+    options.model = "gpt-4o-mini";
+    options.has_temperature = true;
+    options.temperature = 0.7;
+    options.has_top_p = true;
+    options.top_p = 0.95;
+
+    char *json = chatty_to_json_string(1, &message, options, false);
+    if (json == NULL)
+    {
+        fprintf(stderr, "Could not serialize the request\n");
+        return 1;
+    }
+    int failed = strstr(json, "\"temperature\":0.7,") == NULL ||
+                 strstr(json, "\"top_p\":0.95}") == NULL;
+    if (failed)
+    {
+        fprintf(stderr, "Numbers follow the %s locale: %s\n", name, json);
+    }
+    free(json);
+    return failed;
+}
@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chatty.h"
+
+// Streams waiting for an adaptive concurrency slot haven't been sent, so
+// the stream idle timeout must not fire on them however long they wait.
+// A local server keeps every admitted stream busy for longer than the
+// timeout, with an event well within it, so the ninth stream has to queue.
+
+#define STREAMS 9
+#define EVENTS 6
+#define EVENT_INTERVAL_MS 100
+#define IDLE_TIMEOUT_MS 300
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static void send_all(int fd, const char *data)
+{
+    size_t len = strlen(data);
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Reads the request, then answers with a slow event stream and hangs up
+static void *serve_connection(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char request[65536];
+    size_t len = 0;
+    char *body = NULL;
+    long content_length = 0;
+    while (len < sizeof(request) - 1)
+    {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        len += (size_t)n;
+        request[len] = '\0';
+        if (body == NULL && (body = strstr(request, "\r\n\r\n")) != NULL)
+        {
+            body += 4;
+            const char *header = strstr(request, "Content-Length:");
+            if (header == NULL)
+            {
+                header = strstr(request, "content-length:");
+            }
+            content_length = header != NULL ? strtol(header + 15, NULL, 10) : 0;
+        }
+        if (body != NULL && (long)(request + len - body) >= content_length)
+        {
+            break;
+        }
+    }
+
+    send_all(fd, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/event-stream\r\n"
+                 "Connection: close\r\n\r\n");
+    for (int i = 0; i < EVENTS; i++)
+    {
+        send_all(fd, "data: {\"choices\":[{\"delta\":{\"content\":\"x\"}}]}\n\n");
+        sleep_ms(EVENT_INTERVAL_MS);
+    }
+    send_all(fd, "data: [DONE]\n\n");
+    close(fd);
+    return NULL;
+}
+
+static void *serve(void *arg)
+{
+    int listener = *(int *)arg;
+    for (;;)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            return NULL;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)fd) == 0)
+        {
+            pthread_detach(thread);
+        }
+        else
+        {
+            close(fd);
+        }
+    }
+}
+
+static int succeeded, failed;
+
+static int on_chunk(const char *content, chatty_StreamStatus status, void *user_data)
+{
+    (void)content;
+    (void)status;
+    (void)user_data;
+    return 0;
+}
+
+static void on_done(chatty_Request *request, enum chatty_ERROR error, chatty_Message *response, void *user_data)
+{
+    (void)request;
+    (void)response;
+    (void)user_data;
+    if (error == CHATTY_SUCCESS)
+    {
+        succeeded++;
+    }
+    else
+    {
+        fprintf(stderr, "Stream failed: %s\n", chatty_error_string(error));
+        failed++;
+    }
+}
+
+int main(void)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, STREAMS) != 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) != 0)
+    {
+        perror("Could not start the local server");
+        return 1;
+    }
+    pthread_t server;
+    if (pthread_create(&server, NULL, serve, &listener) != 0)
+    {
+        fprintf(stderr, "Could not start the local server\n");
+        return 1;
+    }
+
+    char base_url[64];
+    snprintf(base_url, sizeof(base_url), "http://127.0.0.1:%d", ntohs(addr.sin_port));
+    chatty_ClientOptions client_options;
+    memset(&client_options, 0, sizeof(client_options));
+    client_options.base_url = base_url;
+    client_options.api_key = "test";
+    client_options.adaptive_concurrency = true;
+    chatty_Client *client;
+    if (chatty_client_new(&client_options, &client) != CHATTY_SUCCESS)
+    {
+        fprintf(stderr, "Could not create the client\n");
+        return 1;
+    }
+
+    chatty_Message message = {0};
+    message.role = CHATTY_USER;
+    message.message = "hi";
+    chatty_Options options;
+    memset(&options, 0, sizeof(options));
+    options.model = "test";
+    options.stream_idle_timeout_ms = IDLE_TIMEOUT_MS;
+    for (int i = 0; i < STREAMS; i++)
+    {
+        if (chatty_client_submit_stream(client, 1, &message, options, on_chunk, on_done, NULL, NULL) !=
+            CHATTY_SUCCESS)
+        {
+            fprintf(stderr, "Could not submit stream %d\n", i);
+            return 1;
+        }
+    }
+    int running = 1;
+    while (running > 0)
+    {
+        if (chatty_client_perform(client, 1000, &running) != CHATTY_SUCCESS)
+        {
+            fprintf(stderr, "chatty_client_perform failed\n");
+            return 1;
+        }
+    }
+    chatty_client_free(client);
+
+    if (succeeded != STREAMS)
+    {
+        fprintf(stderr, "%d of %d streams succeeded\n", succeeded, STREAMS);
+        return 1;
+    }
+    return failed != 0;
+}